@@ -5,6 +5,7 @@
 #include <string.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <math.h>
 #include "fiveq.h"
 #include "unsigned.h"
 
@@ -447,6 +448,37 @@ extern void luaQ_openlib (lua_State *L, const char *libname, const luaL_Reg *A,
 # endif
 
 
+/*
+ * Writes n to buff (which must hold LUAI_MAXNUMBER2STR chars) exactly as
+ * lua_number2str would, and returns its length. Integral doubles with no
+ * more digits than "%.14g" shows are converted without going through printf.
+ */
+extern size_t luaQ_number2str (char *buff, lua_Number n) {
+#if defined(LUA_NUMBER_DOUBLE)
+    if (n > -1e14 && n < 1e14 && n == (lua_Number)(long long)n &&
+            !(n == 0 && signbit(n))) {
+        char tmp[16];
+        char *p = tmp + sizeof(tmp);
+        long long i = (long long)n;
+        unsigned long long u = (i < 0) ? 0ULL - (unsigned long long)i
+                                       : (unsigned long long)i;
+        size_t l;
+        do {
+            *--p = (char)('0' + u % 10);
+            u /= 10;
+        } while (u);
+        if (i < 0)
+            *--p = '-';
+        l = (size_t)(tmp + sizeof(tmp) - p);
+        memcpy(buff, p, l);
+        buff[l] = '\0';
+        return l;
+    }
+#endif
+    return (size_t)lua_number2str(buff, n);
+}
+
+
 /* ----------- for 5.1 ---------- */
 #if LUA_VERSION_NUM == 501
 
@@ -646,7 +678,11 @@ extern lua_Unsigned luaL_optunsigned (lua_State *L, int arg, lua_Unsigned def)
 extern const char *luaL_tolstring (lua_State *L, int idx, size_t *len) {
   if (!luaL_callmeta(L, idx, "__tostring")) {  /* no metafield? */
     switch (lua_type(L, idx)) {
-      case LUA_TNUMBER:
+      case LUA_TNUMBER: {
+        char buff[LUAI_MAXNUMBER2STR];
+        lua_pushlstring(L, buff, luaQ_number2str(buff, lua_tonumber(L, idx)));
+        break;
+      }
       case LUA_TSTRING:
         lua_pushvalue(L, idx);
         break;
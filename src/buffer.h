@@ -0,0 +1,37 @@
+/*
+ * buffer.h: a protocol for userdata that expose a block of bytes in memory
+ *
+ * A userdata takes part by starting with a luaQ_Buffer and by having a true
+ * "__buffer" field in its metatable. Consumers (such as struct.unpack) then
+ * read data[0..len-1] in place instead of asking for a string. A provider
+ * that gives up its memory sets len to 0, and must keep data readable for
+ * len bytes as last reported until the userdata is collected.
+ */
+
+#ifndef FIVEQ_BUFFER_H
+#define FIVEQ_BUFFER_H
+
+#include <stddef.h>
+#include <lua.h>
+
+#define LUAQ_BUFFERFIELD	"__buffer"
+
+typedef struct luaQ_Buffer {
+  char *data;
+  size_t len;
+} luaQ_Buffer;
+
+
+/* returns the luaQ_Buffer at idx, or NULL if the value isn't one */
+static luaQ_Buffer *luaQ_tobuffer (lua_State *L, int idx) {
+  luaQ_Buffer *b = (luaQ_Buffer *)lua_touserdata(L, idx);
+  if (b == NULL || !lua_getmetatable(L, idx))
+    return NULL;
+  lua_getfield(L, -1, LUAQ_BUFFERFIELD);
+  if (!lua_toboolean(L, -1))
+    b = NULL;
+  lua_pop(L, 2);
+  return b;
+}
+
+#endif
@@ -22,6 +22,7 @@ extern const char *luaQ_setdeepvalue (lua_State *L, int idx, const char
 extern void luaQ_getfenv (lua_State *L, int level, const char *fname);
 extern void luaQ_setfenv (lua_State *L, int level, const char *fname);
 extern void luaQ_checklib (lua_State *L, const char *libname);
+extern size_t luaQ_number2str (char *buff, lua_Number n);
 /* undocumented */
 extern void luaQ_traceback(lua_State *L, int level, const char *fmt, ...);
 # endif
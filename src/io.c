@@ -8,9 +8,47 @@
  * 4. io.lines, file:lines passes arguments through to read, default to "*l"
  * 5. io.read, file:read now accept "*L" argument
  * 6. file:write now returns file
+ *
+ * Beyond 5.2:
+ * 7. lines are read by scanning stdio's buffer with memchr (embedded NULs kept)
+ * 8. file:linesbatch(n, [tbl]) reads up to n lines per call into a table
+ * 9. file:records(sep, [quote], [tbl]) iterates over delimited records
+ * 10. "*n" parses numerals from stdio's buffer without fscanf;
+ *     file:readnumbers(n, [tbl]) reads up to n numbers per call into a table
+ * 11. file:writeall(tbl, [i], [j]) writes tbl[i..j], with writev for big batches
+ * 12. io.mmap(path, [advice]) maps a file read-only (see buffer.h)
+ * 13. io.copy(src, dst, [len]) copies between files, in the kernel on Linux
+ * 14. os.spawn(argv, [opts]) starts a process with posix_spawn, no shell
+ * 15. file:nonblock, io.pipe, io.socketpair, and (on Linux) io.loop, an epoll
+ *     scheduler whose tasks are coroutines
+ * 16. io.readmany(paths, [opts]) reads many whole files, through io_uring on
+ *     Linux or else a thread pool
+ * 17. io.readfile(path) and io.writefile(path, data, [opts]) read and
+ *     (atomically) replace whole files
+ * 18. file:lineindex([step]) samples line offsets, so file:line(n) and
+ *     file:linerange(from, [to]) seek instead of reading from the start
+ * 19. io.follow(path, [opts]) iterates over lines as they are appended,
+ *     waiting on inotify on Linux and surviving rotation and truncation
+ * 20. io.asyncwriter(target, [opts]) queues writes in a ring that a
+ *     background thread drains
+ * 21. io.open takes "z" modes for gzip files, when built with IO_ZLIB
+ * 22. io.stats([file]) and io.resetstats([file]) report counts, bytes and
+ *     times of reads, writes, opens and closes, when built with IO_STATS
+ * 23. io.buffer(size) makes a reusable block of memory (see buffer.h) that
+ *     file:readinto(buf, n, [offset]) fills without making strings
+ * 24. file:advise(advice, [offset], [len]) passes hints to posix_fadvise, and
+ *     io.open's "d" modes read with O_DIRECT, around the page cache
  */
 
+/* expose POSIX interfaces (and on Linux, GNU ones) even under -std=c99 */
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE
+#endif
+
+#include <ctype.h>
 #include <errno.h>
+#include <limits.h>
+#include <locale.h>
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
@@ -20,6 +58,36 @@
 #include <lualib.h>
 
 #include "fiveq.h"
+#include "buffer.h"
+
+/* GNU extensions of at least glibc maj.min are declared */
+#if defined(__GLIBC__) && defined(_GNU_SOURCE)
+#define l_glibcprereq(maj,min)	\
+  (__GLIBC__ > (maj) || (__GLIBC__ == (maj) && __GLIBC_MINOR__ >= (min)))
+#else
+#define l_glibcprereq(maj,min)	0
+#endif
+
+
+/* seconds on a clock that never jumps, for timeouts and statistics */
+#if defined(LUA_USE_POSIX)
+#include <time.h>
+
+static double monotime (void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (double)ts.tv_sec + (double)ts.tv_nsec * 1e-9;
+}
+
+#elif defined(IO_STATS)
+#include <time.h>
+
+static double monotime (void) {  /* processor time: the best ISO C has */
+  clock_t c = clock();
+  return (double)c / CLOCKS_PER_SEC;
+}
+
+#endif
 
 
 /* --- adapted from lauxlib.c --- */
@@ -125,9 +193,53 @@ static FILE *tofile (lua_State *L) {
 ** before opening the actual file; so, if there is a memory error, the
 ** file is not left opened.
 */
+#if defined(IO_STATS)
+
+/*
+** With IO_STATS, reads, writes, opens and popen closes are counted and
+** timed, for the process as a whole and for each handle made here (these
+** keep their counters after the FILE pointer, so the 5.1 io library's own
+** handles, such as io.stdin, only count towards the total).
+*/
+typedef struct IOStats {
+  lua_Number opens, closes, reads, writes;
+  lua_Number bytesread, byteswritten;
+  double opentime, closetime, readtime, writetime;
+} IOStats;
+
+typedef struct StatFile {
+  FILE *f;  /* must come first */
+  IOStats st;
+} StatFile;
+
+static IOStats iostats;  /* shared by every Lua state in the process */
+
+/* the counters of the file handle at idx, if it has its own */
+static IOStats *handlestats (lua_State *L, int idx) {
+  if (lua_objlen(L, idx) < sizeof(StatFile))
+    return NULL;
+  return &((StatFile *)lua_touserdata(L, idx))->st;
+}
+
+/* counts the open of the handle at pf, which started at t0 */
+static void countopen (FILE **pf, double t0) {
+  t0 = monotime() - t0;
+  iostats.opens++;
+  iostats.opentime += t0;
+  ((StatFile *)pf)->st.opens = 1;
+  ((StatFile *)pf)->st.opentime = t0;
+}
+
+#define FILESIZE	sizeof(StatFile)
+
+#else
+#define FILESIZE	sizeof(FILE *)
+#endif
+
+
 static FILE **newfile (lua_State *L) {
-  FILE **pf = (FILE **)lua_newuserdata(L, sizeof(FILE *));
-  *pf = NULL;  /* file handle is currently `closed' */
+  FILE **pf = (FILE **)lua_newuserdata(L, FILESIZE);
+  memset(pf, 0, FILESIZE);  /* file handle is currently `closed' */
   luaL_getmetatable(L, LUA_FILEHANDLE);
   lua_setmetatable(L, -2);
   return pf;
@@ -139,27 +251,425 @@ static FILE **newfile (lua_State *L) {
 */
 static int io_pclose (lua_State *L) {
   FILE **p = tofilep(L);
+#if defined(IO_STATS)
+  double t0 = monotime();
+  IOStats *hs = handlestats(L, 1);
+#endif
   int stat = ((void)L, (pclose(*p)));
   *p = NULL;
+#if defined(IO_STATS)
+  t0 = monotime() - t0;
+  iostats.closes++;
+  iostats.closetime += t0;
+  if (hs != NULL) {
+    hs->closes++;
+    hs->closetime += t0;
+  }
+#endif
   return luaL_execresult(L, stat);
 }
 
 
 
+/*
+** Files opened for reading get a stdio buffer of this size, so line and
+** block reads need fewer system calls.
+*/
+#if !defined(IO_READBUFSIZE)
+#define IO_READBUFSIZE	65536
+#endif
+
+
+/*
+** With IO_ZLIB, io.open also takes modes ending in "z" (and without "+"):
+** the file is then read or written through zlib's gz functions, behind a
+** FILE made by fopencookie (glibc) or funopen (the BSDs), so that every
+** file method works on it. Reading with "rz" also accepts files that
+** aren't compressed.
+*/
+#if defined(IO_ZLIB)
+#include <limits.h>
+#include <zlib.h>
+
+/* bytes of compressed data zlib buffers */
+#define IO_ZBUFSIZE	(128 * 1024)
+
+
+static int zread (void *cookie, char *buf, size_t n) {
+  int r = gzread((gzFile)cookie, buf, (unsigned)(n < INT_MAX ? n : INT_MAX));
+  if (r < 0) {
+    int zerr;
+    gzerror((gzFile)cookie, &zerr);
+    if (zerr != Z_ERRNO)  /* corrupt data rather than a system error */
+      errno = EIO;
+  }
+  return r;
+}
+
+
+static int zwrite (void *cookie, const char *buf, size_t n) {
+  int r = gzwrite((gzFile)cookie, buf, (unsigned)(n < INT_MAX ? n : INT_MAX));
+  if (r == 0) {
+    int zerr;
+    gzerror((gzFile)cookie, &zerr);
+    if (zerr != Z_ERRNO)
+      errno = EIO;
+    return -1;
+  }
+  return r;
+}
+
+
+/* seeks in the uncompressed data: slow (reading restarts from the start
+   to go backwards), and when writing only forwards */
+static long zseek (void *cookie, long offset, int whence) {
+  z_off_t r;
+  if (whence == SEEK_END) {
+    errno = EINVAL;
+    return -1;
+  }
+  r = gzseek((gzFile)cookie, (z_off_t)offset, whence);
+  if (r < 0 && errno == 0)
+    errno = EINVAL;
+  return (long)r;
+}
+
+
+static int zclose (void *cookie) {
+  return (gzclose((gzFile)cookie) == Z_OK) ? 0 : EOF;
+}
+
+
+#if defined(__GLIBC__) && defined(_GNU_SOURCE)
+
+static ssize_t z_cookieread (void *cookie, char *buf, size_t n) {
+  return zread(cookie, buf, n);
+}
+
+static ssize_t z_cookiewrite (void *cookie, const char *buf, size_t n) {
+  int r = zwrite(cookie, buf, n);
+  return (r < 0) ? 0 : r;  /* glibc takes 0 as an error here */
+}
+
+static int z_cookieseek (void *cookie, off64_t *offset, int whence) {
+  long r;
+  errno = 0;
+  if ((r = zseek(cookie, (long)*offset, whence)) < 0)
+    return -1;
+  *offset = r;
+  return 0;
+}
+
+static FILE *zfile (gzFile gz, const char *mode) {
+  cookie_io_functions_t fns;
+  fns.read = z_cookieread;
+  fns.write = z_cookiewrite;
+  fns.seek = z_cookieseek;
+  fns.close = zclose;
+  return fopencookie(gz, mode, fns);
+}
+
+#elif defined(__FreeBSD__) || defined(__NetBSD__) || defined(__OpenBSD__) || \
+      defined(__DragonFly__) || defined(__APPLE__)
+
+static int z_funread (void *cookie, char *buf, int n) {
+  return zread(cookie, buf, (size_t)n);
+}
+
+static int z_funwrite (void *cookie, const char *buf, int n) {
+  return zwrite(cookie, buf, (size_t)n);
+}
+
+static fpos_t z_funseek (void *cookie, fpos_t offset, int whence) {
+  errno = 0;
+  return (fpos_t)zseek(cookie, (long)offset, whence);
+}
+
+static FILE *zfile (gzFile gz, const char *mode) {
+  return funopen(gz, (mode[0] == 'r') ? z_funread : NULL,
+                 (mode[0] == 'r') ? NULL : z_funwrite, z_funseek, zclose);
+}
+
+#else
+#error "IO_ZLIB needs fopencookie (glibc) or funopen (BSD)"
+#endif
+
+
+/* opens filename for compressed reading or writing; NULL and errno if not */
+static FILE *zopen (const char *filename, const char *mode) {
+  char zmode[3];
+  gzFile gz;
+  FILE *f;
+  zmode[0] = mode[0];
+  zmode[1] = 'b';
+  zmode[2] = '\0';
+  errno = 0;
+  if ((gz = gzopen(filename, zmode)) == NULL) {
+    if (errno == 0) errno = ENOMEM;
+    return NULL;
+  }
+#if ZLIB_VERNUM >= 0x1240
+  gzbuffer(gz, IO_ZBUFSIZE);
+#endif
+  zmode[1] = '\0';
+  if ((f = zfile(gz, zmode)) == NULL) {
+    int en = errno;
+    gzclose(gz);
+    errno = en;
+  }
+  return f;
+}
+
+#endif
+
+
+/*
+** Modes ending in "d" (reading only) read the file with O_DIRECT, around
+** the page cache, so that scanning a big cold file doesn't evict pages
+** that others need. O_DIRECT wants aligned offsets, lengths and memory,
+** so the file is read in blocks into an aligned buffer, behind a FILE
+** made by fopencookie or funopen, as for "z" modes. Where the file system
+** refuses O_DIRECT (tmpfs, for one), the file is read normally and the
+** pages read are dropped with POSIX_FADV_DONTNEED instead.
+*/
+#if defined(LUA_USE_POSIX) && !defined(IO_NO_DIRECT)
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#if defined(O_DIRECT) && ((defined(__GLIBC__) && defined(_GNU_SOURCE)) || \
+    defined(__FreeBSD__) || defined(__NetBSD__) || defined(__DragonFly__))
+#define IO_DIRECT
+#endif
+#endif
+
+#if defined(IO_DIRECT)
+
+/* alignment of offsets and memory; enough for any sector size in use */
+#define IO_DIRECTALIGN	4096
+
+#if !defined(IO_DIRECTBUFSIZE)
+#define IO_DIRECTBUFSIZE	(1024 * 1024)
+#endif
+
+
+typedef struct DirectFile {
+  int fd;
+  int direct;  /* O_DIRECT is set; else pages are dropped after reading */
+  off_t pos;  /* position of the next byte to read */
+  off_t bufoff;  /* file offset of buf[0] */
+  size_t buflen;
+  char *buf;
+} DirectFile;
+
+
+/* reads the aligned block holding pos into the buffer; 0 or -1 */
+static int dfill (DirectFile *d) {
+  off_t off = d->pos - d->pos % IO_DIRECTALIGN;
+  ssize_t r;
+  do
+    r = pread(d->fd, d->buf, IO_DIRECTBUFSIZE, off);
+  while (r < 0 && errno == EINTR);
+  if (r < 0 && errno == EINVAL && d->direct) {  /* refused after all */
+    int flags = fcntl(d->fd, F_GETFL);
+    if (flags < 0 || fcntl(d->fd, F_SETFL, flags & ~O_DIRECT) < 0)
+      return -1;
+    d->direct = 0;
+    return dfill(d);
+  }
+  if (r < 0)
+    return -1;
+  if (!d->direct && r > 0)
+    posix_fadvise(d->fd, off, (off_t)r, POSIX_FADV_DONTNEED);
+  d->bufoff = off;
+  d->buflen = (size_t)r;
+  return 0;
+}
+
+
+static ssize_t dread (void *cookie, char *buf, size_t n) {
+  DirectFile *d = (DirectFile *)cookie;
+  size_t got = 0;
+  while (got < n) {
+    size_t k;
+    if (d->pos < d->bufoff || d->pos >= d->bufoff + (off_t)d->buflen) {
+      if (dfill(d) != 0)
+        return (got > 0) ? (ssize_t)got : -1;
+      if (d->pos >= d->bufoff + (off_t)d->buflen)
+        break;  /* end of file */
+    }
+    k = (size_t)(d->bufoff + (off_t)d->buflen - d->pos);
+    if (k > n - got)
+      k = n - got;
+    memcpy(buf + got, d->buf + (d->pos - d->bufoff), k);
+    d->pos += (off_t)k;
+    got += k;
+  }
+  return (ssize_t)got;
+}
+
+
+static int dseek (void *cookie, off_t *offset, int whence) {
+  DirectFile *d = (DirectFile *)cookie;
+  off_t base = 0;
+  if (whence == SEEK_CUR)
+    base = d->pos;
+  else if (whence == SEEK_END) {
+    struct stat st;
+    if (fstat(d->fd, &st) != 0)
+      return -1;
+    base = st.st_size;
+  }
+  if (base + *offset < 0) {
+    errno = EINVAL;
+    return -1;
+  }
+  *offset = d->pos = base + *offset;
+  return 0;
+}
+
+
+static int dclose (void *cookie) {
+  DirectFile *d = (DirectFile *)cookie;
+  int r = close(d->fd);
+  free(d->buf);
+  free(d);
+  return (r == 0) ? 0 : EOF;
+}
+
+
+#if defined(__GLIBC__) && defined(_GNU_SOURCE)
+
+static int d_cookieseek (void *cookie, off64_t *offset, int whence) {
+  off_t o = (off_t)*offset;
+  if (dseek(cookie, &o, whence) != 0)
+    return -1;
+  *offset = o;
+  return 0;
+}
+
+static FILE *dfile (DirectFile *d) {
+  cookie_io_functions_t fns;
+  fns.read = dread;
+  fns.write = NULL;
+  fns.seek = d_cookieseek;
+  fns.close = dclose;
+  return fopencookie(d, "r", fns);
+}
+
+#else
+
+static int d_funread (void *cookie, char *buf, int n) {
+  return (int)dread(cookie, buf, (size_t)n);
+}
+
+static fpos_t d_funseek (void *cookie, fpos_t offset, int whence) {
+  off_t o = (off_t)offset;
+  return (dseek(cookie, &o, whence) == 0) ? (fpos_t)o : -1;
+}
+
+static FILE *dfile (DirectFile *d) {
+  return funopen(d, d_funread, NULL, d_funseek, dclose);
+}
+
+#endif
+
+
+/* opens filename for direct reading; NULL and errno if not */
+static FILE *dopen (const char *filename) {
+  DirectFile *d = (DirectFile *)malloc(sizeof(DirectFile));
+  void *buf;
+  FILE *f;
+  int en;
+  if (d == NULL) {
+    errno = ENOMEM;
+    return NULL;
+  }
+  if ((en = posix_memalign(&buf, IO_DIRECTALIGN, IO_DIRECTBUFSIZE)) != 0) {
+    free(d);
+    errno = en;
+    return NULL;
+  }
+  d->buf = (char *)buf;
+  d->pos = d->bufoff = 0;
+  d->buflen = 0;
+  d->direct = 1;
+  d->fd = open(filename, O_RDONLY | O_DIRECT);
+  if (d->fd < 0 && errno == EINVAL) {  /* file system without O_DIRECT */
+    d->direct = 0;
+    d->fd = open(filename, O_RDONLY);
+  }
+  if (d->fd < 0 || (f = dfile(d)) == NULL) {
+    en = errno;
+    if (d->fd >= 0)
+      close(d->fd);
+    free(d->buf);
+    free(d);
+    errno = en;
+    return NULL;
+  }
+  return f;
+}
+
+#endif
+
+
+#if defined(IO_ZLIB) && defined(IO_DIRECT)
+#define MODEEXT		"dz"
+#define MODEPATTERN	"[rwa]%%+?b?[dz]?"
+#elif defined(IO_ZLIB)
+#define MODEEXT		"z"
+#define MODEPATTERN	"[rwa]%%+?b?z?"
+#elif defined(IO_DIRECT)
+#define MODEEXT		"d"
+#define MODEPATTERN	"[rwa]%%+?b?d?"
+#else
+#define MODEPATTERN	"[rwa]%%+?b?"
+#endif
+
+
 static int io_open (lua_State *L) {
   const char *filename = luaL_checkstring(L, 1);
   const char *mode = luaL_optstring(L, 2, "r");
   FILE **pf = newfile(L);
   int i = 0;
-  /* check whether 'mode' matches '[rwa]%+?b?' */
+#if defined(MODEEXT)
+  int ext = '\0';  /* "z" or "d" suffix */
+#endif
+#if defined(IO_STATS)
+  double t0 = monotime();
+#endif
+  /* check whether 'mode' matches MODEPATTERN */
   if (!(mode[i] != '\0' && strchr("rwa", mode[i++]) != NULL &&
        (mode[i] != '+' || ++i) &&  /* skip if char is '+' */
        (mode[i] != 'b' || ++i) &&  /* skip if char is 'b' */
+#if defined(MODEEXT)
+       (mode[i] == '\0' || strchr(MODEEXT, mode[i]) == NULL ||
+        (mode[1] != '+' && (mode[i] != 'd' || mode[0] == 'r') &&
+         (ext = mode[i++]))) &&
+#endif
        (mode[i] == '\0')))
     return luaL_error(L, "invalid mode " LUA_QL("%s")
-                         " (should match " LUA_QL("[rwa]%%+?b?") ")", mode);
+                         " (should match " LUA_QL(MODEPATTERN) ")", mode);
+#if defined(IO_ZLIB)
+  if (ext == 'z')
+    *pf = zopen(filename, mode);
+  else
+#endif
+#if defined(IO_DIRECT)
+  if (ext == 'd')
+    *pf = dopen(filename);
+  else
+#endif
   *pf = fopen(filename, mode);
-  return (*pf == NULL) ? luaL_fileresult(L, 0, filename) : 1;
+  if (*pf == NULL)
+    return luaL_fileresult(L, 0, filename);
+  if (mode[0] == 'r' && mode[1] != '+')
+    setvbuf(*pf, NULL, _IOFBF, IO_READBUFSIZE);
+#if defined(IO_STATS)
+  countopen(pf, t0);
+#endif
+  return 1;
 }
 
 
@@ -200,11 +710,18 @@ static int io_lines (lua_State *L) {
    else {  /* open a new file */
     const char *filename = luaL_checkstring(L, 1);
     FILE **pf = newfile(L);
+#if defined(IO_STATS)
+    double t0 = monotime();
+#endif
     *pf = fopen(filename, "r");
     if (*pf == NULL) {
       lua_pushfstring(L, "%s: %s", filename, strerror(errno));
       luaL_argerror(L, 1, lua_tostring(L, -1));
     }
+    setvbuf(*pf, NULL, _IOFBF, IO_READBUFSIZE);
+#if defined(IO_STATS)
+    countopen(pf, t0);
+#endif
     lua_replace(L, 1);  /* put file at index 1 */
     toclose = 1;  /* close it after iteration */
   }
@@ -214,19 +731,6 @@ static int io_lines (lua_State *L) {
 
 
 
-static int read_number (lua_State *L, FILE *f) {
-  lua_Number d;
-  if (fscanf(f, LUA_NUMBER_SCAN, &d) == 1) {
-    lua_pushnumber(L, d);
-    return 1;
-  }
-  else {
-    lua_pushnil(L); /* "result" to be removed */
-    return 0;  /* read fails */
-  }
-}
-
-
 static int test_eof (lua_State *L, FILE *f) {
   int c = getc(f);
   ungetc(c, f);
@@ -235,177 +739,4187 @@ static int test_eof (lua_State *L, FILE *f) {
 }
 
 
-static int read_line (lua_State *L, FILE *f, int chop) {
-  luaL_Buffer b;
-  luaL_buffinit(L, &b);
-  for (;;) {
-    size_t l;
-    char *p = luaL_prepbuffer(&b);
-    if (fgets(p, LUAL_BUFFERSIZE, f) == NULL) {  /* eof? */
-      luaL_pushresult(&b);  /* close buffer */
-      return (lua_objlen(L, -1) > 0);  /* check whether read something */
-    }
-    l = strlen(p);
-    if (l == 0 || p[l-1] != '\n')
-      luaL_addsize(&b, l);
-    else {
-      luaL_addsize(&b, l - chop);  /* chop 'eol' if needed */
-      luaL_pushresult(&b);  /* close buffer */
-      return 1;  /* read at least an `eol' */
-    }
-  }
+/*
+** Direct access to the data stdio has buffered for reading, so that
+** newlines can be found with memchr and whole runs copied at once.
+** readptr returns NULL when nothing is buffered (or the C library's FILE
+** is opaque); the caller then reads a character with l_getc, which also
+** refills the buffer.
+*/
+#if defined(__GLIBC__)
+
+static const char *readptr (FILE *f, size_t *n) {
+  if (f->_IO_write_ptr > f->_IO_write_base)  /* pending output? */
+    return NULL;
+  *n = f->_IO_read_end - f->_IO_read_ptr;
+  return (*n > 0) ? f->_IO_read_ptr : NULL;
 }
 
+#define readinc(f,n)	((f)->_IO_read_ptr += (n))
 
-static int read_chars (lua_State *L, FILE *f, size_t n) {
-  size_t rlen;  /* how much to read */
-  size_t nr;  /* number of chars actually read */
-  char *p;
-  luaL_Buffer b;
-  luaL_buffinit(L, &b);
-  rlen = LUAL_BUFFERSIZE;  /* try to read that much each time */
-  do {
-    p = luaL_prepbuffer(&b);
-    if (rlen > n) rlen = n;  /* cannot read more than asked */
-    nr = fread(p, sizeof(char), rlen, f);
-    luaL_addsize(&b, nr);
-    n -= nr;  /* still have to read `n' chars */
-  } while (n > 0 && nr == rlen);  /* until end of count or eof */
-  luaL_pushresult(&b);  /* close buffer */
-  return (n == 0 || lua_objlen(L, -1) > 0);
+#elif defined(__sferror) || defined(__DragonFly__)  /* BSD stdio */
+
+static const char *readptr (FILE *f, size_t *n) {
+  if ((f->_flags & __SWR) || f->_r <= 0)
+    return NULL;
+  *n = f->_r;
+  return (const char *)f->_p;
 }
 
+#define readinc(f,n)	((f)->_p += (n), (f)->_r -= (n))
 
-static int g_read (lua_State *L, FILE *f, int first) {
-  int nargs = lua_gettop(L) - 1;
-  int success;
-  int n;
-  clearerr(f);
-  if (nargs == 0 || lua_isnil(L, first)) {  /* no arguments? */
-    success = read_line(L, f, 1);
-    n = first+1;  /* to return 1 result */
-  }
-  else {  /* ensure stack space for all results and for auxlib's buffer */
-    luaL_checkstack(L, nargs+LUA_MINSTACK, "too many arguments");
-    success = 1;
-    for (n = first; nargs-- && success; n++) {
-      if (lua_type(L, n) == LUA_TNUMBER) {
-        size_t l = (size_t)lua_tointeger(L, n);
-        success = (l == 0) ? test_eof(L, f) : read_chars(L, f, l);
-      }
-      else {
-        const char *p = lua_tostring(L, n);
-        luaL_argcheck(L, p && p[0] == '*', n, "invalid option");
-        switch (p[1]) {
-          case 'n':  /* number */
-            success = read_number(L, f);
-            break;
-          case 'l':  /* line */
-            success = read_line(L, f, 1);
-            break;
-          case 'L':  /* line with end-of-line */
-            success = read_line(L, f, 0);
-            break;
-          case 'a':  /* file */
-            read_chars(L, f, ~((size_t)0));  /* read MAX_SIZE_T chars */
-            success = 1; /* always success */
-            break;
-          default:
-            return luaL_argerror(L, n, "invalid format");
-        }
-      }
-    }
-  }
-  if (ferror(f))
-    return luaL_fileresult(L, 0, NULL);
-  if (!success) {
-    lua_pop(L, 1);  /* remove last result */
-    lua_pushnil(L);  /* push nil instead */
-  }
-  return n - first;
-}
+#else
 
+#define readptr(f,n)	((void)(f), (void)(n), (const char *)NULL)
+#define readinc(f,n)	((void)(f), (void)(n))
 
-static int io_read (lua_State *L) {
-  FILE *f;
-  lua_rawgeti(L, LUA_ENVIRONINDEX, IO_INPUT);
-  f = *(FILE **)lua_touserdata(L, -1);
-  if (f == NULL)
+#endif
+
+
+#if defined(LUA_USE_POSIX)
+#define l_getc(f)		getc_unlocked(f)
+#define l_lockfile(f)		flockfile(f)
+#define l_unlockfile(f)		funlockfile(f)
+#else
+#define l_getc(f)		getc(f)
+#define l_lockfile(f)		((void)0)
+#define l_unlockfile(f)		((void)0)
+#endif
+
+
+/*
+** The stream lock is never held across calls into Lua, since one may raise
+** an error (out of memory) and leave the stream locked for good. Scans of
+** stdio's buffer take it, and so does consuming what they found, with
+** readlocked; the Lua calls copying the bytes out come in between.
+*/
+static void readlocked (FILE *f, size_t n) {
+  l_lockfile(f);
+  readinc(f, n);
+  l_unlockfile(f);
+}
+
+
+/* luaL_addlstring, but copying in blocks (5.1's adds char by char) */
+static void addblock (luaL_Buffer *b, const char *s, size_t l) {
+  while (l > 0) {
+    size_t k = (l < LUAL_BUFFERSIZE) ? l : LUAL_BUFFERSIZE;
+    char *p = luaL_prepbuffer(b);
+    memcpy(p, s, k);
+    luaL_addsize(b, k);
+    s += k;
+    l -= k;
+  }
+}
+
+
+/* --- adapted from lua-5.3.0 liolib.c --- */
+
+/* maximum length of a numeral */
+#define L_MAXLENNUM	200
+
+
+/* auxiliary structure used by 'read_number' */
+typedef struct {
+  FILE *f;  /* file being read */
+  int c;  /* current character (look ahead) */
+  int n;  /* number of elements in buffer 'buff' */
+  char buff[L_MAXLENNUM + 1];  /* +1 for ending '\0' */
+} RN;
+
+
+/*
+** Add current char to buffer (if not out of space) and read next one
+*/
+static int nextc (RN *rn) {
+  if (rn->n >= L_MAXLENNUM) {  /* buffer overflow? */
+    rn->buff[0] = '\0';  /* invalidate result */
+    return 0;  /* fail */
+  }
+  else {
+    rn->buff[rn->n++] = rn->c;  /* save current char */
+    rn->c = l_getc(rn->f);  /* read next one */
+    return 1;
+  }
+}
+
+
+/*
+** Accept current char if it is in 'set' (of size 1 or 2)
+*/
+static int test2 (RN *rn, const char *set) {
+  if (rn->c != EOF && (rn->c == set[0] || rn->c == set[1]))
+    return nextc(rn);
+  else return 0;
+}
+
+
+/*
+** Read a sequence of (hex)digits
+*/
+static int readdigits (RN *rn, int hex) {
+  int count = 0;
+  while ((hex ? isxdigit(rn->c) : isdigit(rn->c)) && nextc(rn))
+    count++;
+  return count;
+}
+
+
+/* exact powers of ten as doubles */
+static const double exactpow10[] = {
+  1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+  1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+};
+
+
+/*
+** Convert a decimal numeral accepted by scan_number. When it has at most
+** 15 significant digits and a small exponent, both the digits and the
+** power of ten are exact doubles, so one multiplication or division gives
+** the correctly rounded result; other numerals go to strtod, with '.'
+** translated to the locale's decimal point.
+*/
+static int str2number (char *s, int hex, lua_Number *d) {
+  char *endptr;
+  char *point;
+  if (!hex) {
+    const char *p = s;
+    unsigned long long m = 0;
+    int digits = 0, e = 0, exact = 1, neg = 0;
+    if (*p == '-' || *p == '+')
+      neg = (*p++ == '-');
+    for (; isdigit((unsigned char)*p); p++) {
+      if (digits < 15) {
+        m = m * 10 + (*p - '0');
+        digits += (m != 0);
+      }
+      else {
+        exact = 0;
+        break;
+      }
+    }
+    if (exact && *p == '.') {
+      for (p++; isdigit((unsigned char)*p); p++) {
+        if (digits < 15) {
+          m = m * 10 + (*p - '0');
+          digits += (m != 0);
+          e--;
+        }
+        else {
+          exact = 0;
+          break;
+        }
+      }
+    }
+    if (exact && (*p == 'e' || *p == 'E')) {
+      int ex = 0, eneg = 0;
+      p++;
+      if (*p == '-' || *p == '+')
+        eneg = (*p++ == '-');
+      if (!isdigit((unsigned char)*p))
+        return 0;  /* malformed exponent */
+      for (; isdigit((unsigned char)*p); p++)
+        if (ex < 10000) ex = ex * 10 + (*p - '0');
+      e += eneg ? -ex : ex;
+    }
+    if (exact && *p == '\0') {
+      if (m == 0)
+        *d = 0.0;
+      else if (0 <= e && e <= 22)
+        *d = (lua_Number)m * exactpow10[e];
+      else if (-22 <= e && e < 0)
+        *d = (lua_Number)m / exactpow10[-e];
+      else
+        exact = 0;
+      if (exact) {
+        if (neg) *d = -*d;
+        return 1;
+      }
+    }
+  }
+  if ((point = strchr(s, '.')) != NULL)  /* numerals always use '.' */
+    *point = localeconv()->decimal_point[0];
+  *d = (lua_Number)strtod(s, &endptr);
+  return (endptr != s && *endptr == '\0');
+}
+
+
+/*
+** Read a number: first reads a valid prefix of a numeral into a buffer.
+** Then it calls 'str2number' to check whether the format is correct and
+** to convert it to a Lua number. The caller holds the file's lock.
+*/
+static int scan_number (FILE *f, lua_Number *d) {
+  RN rn;
+  int count = 0;
+  int hex = 0;
+  rn.f = f; rn.n = 0;
+  do { rn.c = l_getc(rn.f); } while (isspace(rn.c));  /* skip spaces */
+  test2(&rn, "-+");  /* optional signal */
+  if (test2(&rn, "00")) {
+    if (test2(&rn, "xX")) hex = 1;  /* numeral is hexadecimal */
+    else count = 1;  /* count initial '0' as a valid digit */
+  }
+  count += readdigits(&rn, hex);  /* integral part */
+  if (test2(&rn, ".."))  /* decimal point? */
+    count += readdigits(&rn, hex);  /* fractional part */
+  if (count > 0 && test2(&rn, (hex ? "pP" : "eE"))) {  /* exponent mark? */
+    test2(&rn, "-+");  /* exponent signal */
+    readdigits(&rn, 0);  /* exponent digits */
+  }
+  ungetc(rn.c, rn.f);  /* unread look-ahead char */
+  rn.buff[rn.n] = '\0';  /* finish string */
+  return (count > 0 && str2number(rn.buff, hex, d));
+}
+
+
+static int read_number (lua_State *L, FILE *f) {
+  lua_Number d;
+  int ok;
+  l_lockfile(f);
+  ok = scan_number(f, &d);
+  l_unlockfile(f);
+  if (ok) {
+    lua_pushnumber(L, d);
+    return 1;
+  }
+  else {
+    lua_pushnil(L); /* "result" to be removed */
+    return 0;  /* read fails */
+  }
+}
+
+
+static int read_line (lua_State *L, FILE *f, int chop) {
+  luaL_Buffer b;
+  int empty = 1;  /* nothing added to b yet? */
+  int c;
+  luaL_buffinit(L, &b);
+  for (;;) {
+    size_t n;
+    const char *p, *e = NULL;
+    l_lockfile(f);
+    if ((p = readptr(f, &n)) != NULL)
+      e = (const char *)memchr(p, '\n', n);
+    l_unlockfile(f);
+    if (p != NULL) {
+      if (e != NULL) {  /* line ends inside the buffer */
+        size_t l = e - p;
+        if (empty)  /* whole line was buffered: skip luaL_Buffer */
+          lua_pushlstring(L, p, l + !chop);
+        else {
+          addblock(&b, p, l + !chop);
+          luaL_pushresult(&b);
+        }
+        readlocked(f, l + 1);
+        break;
+      }
+      addblock(&b, p, n);
+      readlocked(f, n);
+      empty = 0;
+    }
+    else if ((c = getc(f)) == EOF) {  /* buffer empty: refill or eof */
+      luaL_pushresult(&b);  /* close buffer */
+      return (lua_objlen(L, -1) > 0);  /* check whether read something */
+    }
+    else if (c == '\n') {
+      if (!chop)
+        luaL_addchar(&b, c);
+      luaL_pushresult(&b);
+      break;
+    }
+    else {
+      luaL_addchar(&b, c);
+      empty = 0;
+    }
+  }
+  return 1;  /* read at least an `eol' */
+}
+
+
+static int read_chars (lua_State *L, FILE *f, size_t n) {
+  size_t rlen;  /* how much to read */
+  size_t nr;  /* number of chars actually read */
+  char *p;
+  luaL_Buffer b;
+  luaL_buffinit(L, &b);
+  rlen = LUAL_BUFFERSIZE;  /* try to read that much each time */
+  do {
+    p = luaL_prepbuffer(&b);
+    if (rlen > n) rlen = n;  /* cannot read more than asked */
+    nr = fread(p, sizeof(char), rlen, f);
+    luaL_addsize(&b, nr);
+    n -= nr;  /* still have to read `n' chars */
+  } while (n > 0 && nr == rlen);  /* until end of count or eof */
+  luaL_pushresult(&b);  /* close buffer */
+  return (n == 0 || lua_objlen(L, -1) > 0);
+}
+
+
+static int g_read (lua_State *L, FILE *f, int first) {
+  int nargs = lua_gettop(L) - 1;
+  int success;
+  int n;
+  clearerr(f);
+  if (nargs == 0 || lua_isnil(L, first)) {  /* no arguments? */
+    success = read_line(L, f, 1);
+    n = first+1;  /* to return 1 result */
+  }
+  else {  /* ensure stack space for all results and for auxlib's buffer */
+    luaL_checkstack(L, nargs+LUA_MINSTACK, "too many arguments");
+    success = 1;
+    for (n = first; nargs-- && success; n++) {
+      if (lua_type(L, n) == LUA_TNUMBER) {
+        size_t l = (size_t)lua_tointeger(L, n);
+        success = (l == 0) ? test_eof(L, f) : read_chars(L, f, l);
+      }
+      else {
+        const char *p = lua_tostring(L, n);
+        luaL_argcheck(L, p && p[0] == '*', n, "invalid option");
+        switch (p[1]) {
+          case 'n':  /* number */
+            success = read_number(L, f);
+            break;
+          case 'l':  /* line */
+            success = read_line(L, f, 1);
+            break;
+          case 'L':  /* line with end-of-line */
+            success = read_line(L, f, 0);
+            break;
+          case 'a':  /* file */
+            read_chars(L, f, ~((size_t)0));  /* read MAX_SIZE_T chars */
+            success = 1; /* always success */
+            break;
+          default:
+            return luaL_argerror(L, n, "invalid format");
+        }
+      }
+    }
+  }
+  if (ferror(f))
+    return luaL_fileresult(L, 0, NULL);
+  if (!success) {
+    lua_pop(L, 1);  /* remove last result */
+    lua_pushnil(L);  /* push nil instead */
+  }
+  return n - first;
+}
+
+
+#if defined(IO_STATS)
+
+/* g_read, counting the bytes of its results towards the handle at ud */
+static int readcounted (lua_State *L, FILE *f, int first, int ud) {
+  double t0 = monotime();
+  IOStats *hs = handlestats(L, ud);
+  lua_Number bytes = 0;
+  int n = g_read(L, f, first), i;
+  for (i = 1; i <= n; i++)
+    if (lua_type(L, -i) == LUA_TSTRING)
+      bytes += lua_objlen(L, -i);
+  t0 = monotime() - t0;
+  iostats.reads++;
+  iostats.bytesread += bytes;
+  iostats.readtime += t0;
+  if (hs != NULL) {
+    hs->reads++;
+    hs->bytesread += bytes;
+    hs->readtime += t0;
+  }
+  return n;
+}
+
+#else
+#define readcounted(L,f,first,ud)	g_read(L, f, first)
+#endif
+
+
+static int io_read (lua_State *L) {
+  FILE *f;
+  lua_rawgeti(L, LUA_ENVIRONINDEX, IO_INPUT);
+  f = *(FILE **)lua_touserdata(L, -1);
+  if (f == NULL)
     return luaL_error(L, "standard input file is closed");
-  return g_read(L, f, 1);
+  return readcounted(L, f, 1, lua_gettop(L));
+}
+
+
+static int f_read (lua_State *L) {
+  return readcounted(L, tofile(L), 2, 1);
+}
+
+
+
+/* slots preallocated in a new batch table; a bigger n grows it as it fills */
+#define BATCHPREALLOC	4096
+
+
+/*
+** file:linesbatch(n, [tbl]): read up to n lines (without their newlines)
+** into tbl[1..k], clearing any entries after k; returns k, which is 0 at
+** end of file, and tbl (a new table if none was given).
+*/
+static int f_linesbatch (lua_State *L) {
+  FILE *f = tofile(L);
+  int n = luaL_checkint(L, 2);
+  int k, old;
+  luaL_argcheck(L, n > 0, 2, "positive count expected");
+  if (lua_isnoneornil(L, 3)) {
+    lua_settop(L, 2);
+    lua_createtable(L, (n < BATCHPREALLOC) ? n : BATCHPREALLOC, 0);
+  }
+  else {
+    luaL_checktype(L, 3, LUA_TTABLE);
+    lua_settop(L, 3);
+  }
+  old = (int)lua_objlen(L, 3);
+  clearerr(f);
+  for (k = 0; k < n; k++) {
+    if (!read_line(L, f, 1)) {
+      lua_pop(L, 1);
+      break;
+    }
+    lua_rawseti(L, 3, k + 1);
+  }
+  if (ferror(f))
+    return luaL_fileresult(L, 0, NULL);
+  for (; old > k; old--) {  /* clear stale lines */
+    lua_pushnil(L);
+    lua_rawseti(L, 3, old);
+  }
+  lua_pushinteger(L, k);
+  lua_pushvalue(L, 3);
+  return 2;
+}
+
+
+/*
+** file:readnumbers(n, [tbl]): read up to n numbers into tbl[1..k], stopping
+** early at end of file or at anything that isn't a numeral; clears any
+** entries after k and returns k and tbl (a new table if none was given).
+*/
+static int f_readnumbers (lua_State *L) {
+  FILE *f = tofile(L);
+  int n = luaL_checkint(L, 2);
+  int k, old;
+  luaL_argcheck(L, n > 0, 2, "positive count expected");
+  if (lua_isnoneornil(L, 3)) {
+    lua_settop(L, 2);
+    lua_createtable(L, (n < BATCHPREALLOC) ? n : BATCHPREALLOC, 0);
+  }
+  else {
+    luaL_checktype(L, 3, LUA_TTABLE);
+    lua_settop(L, 3);
+  }
+  old = (int)lua_objlen(L, 3);
+  clearerr(f);
+  for (k = 0; k < n; k++) {
+    lua_Number d;
+    int ok;
+    l_lockfile(f);
+    ok = scan_number(f, &d);
+    l_unlockfile(f);
+    if (!ok)
+      break;
+    lua_pushnumber(L, d);
+    lua_rawseti(L, 3, k + 1);
+  }
+  if (ferror(f))
+    return luaL_fileresult(L, 0, NULL);
+  for (; old > k; old--) {  /* clear stale numbers */
+    lua_pushnil(L);
+    lua_rawseti(L, 3, old);
+  }
+  lua_pushinteger(L, k);
+  lua_pushvalue(L, 3);
+  return 2;
+}
+
+
+/* upvalue[1]=file; upvalue[2]=created file?; upvalue[3]=number of saved args; upvalues[4+]=args... */
+static int io_readline (lua_State *L) {
+   FILE *f = *(FILE **)lua_touserdata(L, lua_upvalueindex(1));
+   if (f == NULL)  /* file is already closed? */
+     luaL_error(L, "file is already closed");
+   lua_settop(L, 1);
+   int n = (int)lua_tointeger(L, lua_upvalueindex(3));
+   int i;
+   for (i = 1; i <= n; i++)  /* push arguments to 'g_read' */
+     lua_pushvalue(L, lua_upvalueindex(3 + i));
+   n = readcounted(L, f, 2, lua_upvalueindex(1));  /* 'n' is number of results */
+   lua_assert(n > 0);  /* should return at least a nil */
+   if (!lua_isnil(L, -n))  /* read at least one value? */
+     return n;  /* return them */
+   else {  /* first result is nil: EOF or error */
+     if (!lua_isnil(L, -1))  /* is there error information? */
+       return luaL_error(L, "%s", lua_tostring(L, -1));  /* error */
+     /* else EOF */
+     if (lua_toboolean(L, lua_upvalueindex(2))) {  /* generator created file? */
+      lua_settop(L, 0);
+      lua_pushvalue(L, lua_upvalueindex(1));
+      /* close it */
+      lua_getfenv(L, 1);
+      lua_getfield(L, -1, "__close");
+      (lua_tocfunction(L, -1))(L);
+      return 0;  /* not close's results, which would continue the loop */
+    }
+    return 0;
+  }
+}
+
+
+/* --- line offset index --- */
+
+#define LINEINDEX	"fiveq.io.lineindex"
+#define LINEINDEXES	"fiveq.io.lineindexes"  /* file -> index, weak keys */
+
+/* lines per recorded offset, unless file:lineindex is told otherwise */
+#if !defined(LINEINDEXSTEP)
+#define LINEINDEXSTEP	1024
+#endif
+
+#if defined(LUA_USE_POSIX)
+#define l_fseek(f,o,w)	fseeko(f, (off_t)(o), w)
+#else
+#define l_fseek(f,o,w)	fseek(f, (long)(o), w)
+#endif
+
+typedef long long l_lineoff;
+
+typedef struct LineIndex {
+  l_lineoff step;  /* offs[k] is where line k * step + 1 starts */
+  l_lineoff nlines;  /* lines in the file when indexed */
+  l_lineoff size;  /* length of the file when indexed */
+  size_t n, cap;  /* entries used and allocated in offs */
+  l_lineoff *offs;  /* malloc'd */
+} LineIndex;
+
+
+static LineIndex *newindex (lua_State *L, l_lineoff step) {
+  LineIndex *ix = (LineIndex *)lua_newuserdata(L, sizeof(LineIndex));
+  memset(ix, 0, sizeof(LineIndex));
+  ix->step = step;
+  luaL_getmetatable(L, LINEINDEX);
+  lua_setmetatable(L, -2);
+  return ix;
+}
+
+
+static int addoffset (LineIndex *ix, l_lineoff off) {
+  if (ix->n == ix->cap) {
+    size_t cap = ix->cap ? 2 * ix->cap : 64;
+    l_lineoff *offs = (l_lineoff *)realloc(ix->offs, cap * sizeof(l_lineoff));
+    if (offs == NULL)
+      return 0;
+    ix->offs = offs;
+    ix->cap = cap;
+  }
+  ix->offs[ix->n++] = off;
+  return 1;
+}
+
+
+/*
+** Scans f from its start, finding newlines with memchr in stdio's buffer
+** as read_line does, and records where every step'th line starts.
+*/
+static int buildindex (FILE *f, LineIndex *ix) {
+  l_lineoff pos = 0, lines = 0;
+  int lastnl = 1, ok = 1, c;
+  ix->n = 0;
+  if (l_fseek(f, 0, SEEK_SET) != 0)
+    return 0;
+  if (!addoffset(ix, 0)) {
+    errno = ENOMEM;
+    return 0;
+  }
+  clearerr(f);
+  l_lockfile(f);
+  while (ok) {
+    size_t n;
+    const char *p = readptr(f, &n);
+    if (p != NULL) {
+      const char *q = p, *end = p + n, *e;
+      while ((e = (const char *)memchr(q, '\n', end - q)) != NULL) {
+        pos += e - q + 1;
+        q = e + 1;
+        if (++lines % ix->step == 0 && !(ok = addoffset(ix, pos)))
+          break;
+      }
+      pos += end - q;
+      lastnl = (q == end);
+      readinc(f, n);
+    }
+    else if ((c = l_getc(f)) == EOF)
+      break;
+    else {
+      pos++;
+      lastnl = (c == '\n');
+      if (lastnl && ++lines % ix->step == 0)
+        ok = addoffset(ix, pos);
+    }
+  }
+  l_unlockfile(f);
+  if (!ok) {
+    errno = ENOMEM;
+    return 0;
+  }
+  ix->nlines = lines + !lastnl;  /* a last line may lack its newline */
+  ix->size = pos;
+  return !ferror(f);
+}
+
+
+/* skips up to n lines from f's position; returns how many it skipped */
+static l_lineoff skiplines (FILE *f, l_lineoff n) {
+  l_lineoff k = 0;
+  int c;
+  l_lockfile(f);
+  while (k < n) {
+    size_t avail;
+    const char *p = readptr(f, &avail);
+    if (p != NULL) {
+      const char *e = (const char *)memchr(p, '\n', avail);
+      if (e != NULL) {
+        readinc(f, e - p + 1);
+        k++;
+      }
+      else
+        readinc(f, avail);
+    }
+    else if ((c = l_getc(f)) == EOF)
+      break;
+    else if (c == '\n')
+      k++;
+  }
+  l_unlockfile(f);
+  return k;
+}
+
+
+/* the index of the file at 1, built with the default step if it has none */
+static LineIndex *fileindex (lua_State *L, FILE *f) {
+  LineIndex *ix;
+  lua_getfield(L, LUA_REGISTRYINDEX, LINEINDEXES);
+  lua_pushvalue(L, 1);
+  lua_rawget(L, -2);
+  ix = (LineIndex *)lua_touserdata(L, -1);
+  if (ix == NULL) {
+    lua_pop(L, 1);
+    ix = newindex(L, LINEINDEXSTEP);
+    if (!buildindex(f, ix)) {
+      luaL_fileresult(L, 0, NULL);
+      luaL_error(L, "%s", lua_tostring(L, -2));
+    }
+    lua_pushvalue(L, 1);
+    lua_pushvalue(L, -2);
+    lua_rawset(L, -4);
+  }
+  lua_remove(L, -2);
+  return ix;
+}
+
+
+/* positions f at the start of line n; false if the index has no line n */
+static int seekline (lua_State *L, FILE *f, LineIndex *ix, l_lineoff n) {
+  l_lineoff k = (n - 1) / ix->step;
+  if (n > ix->nlines || (size_t)k >= ix->n)
+    return 0;
+  clearerr(f);
+  if (l_fseek(f, ix->offs[k], SEEK_SET) != 0) {
+    luaL_fileresult(L, 0, NULL);
+    luaL_error(L, "%s", lua_tostring(L, -2));
+  }
+  return skiplines(f, (n - 1) % ix->step) == (n - 1) % ix->step;
+}
+
+
+static l_lineoff checklineno (lua_State *L, int arg) {
+  lua_Number n = luaL_checknumber(L, arg);
+  luaL_argcheck(L, n >= 1, arg, "positive line number expected");
+  return (l_lineoff)n;
+}
+
+
+/*
+** file:lineindex([step]): scans the whole file and keeps, for file:line
+** and file:linerange, the offset of every step'th line (default 1024);
+** returns the index. file:lineindex(index) attaches an index made earlier
+** (for instance by io.lineindex) instead.
+*/
+static int f_lineindex (lua_State *L) {
+  FILE *f = tofile(L);
+  if (lua_isuserdata(L, 2)) {
+    luaL_checkudata(L, 2, LINEINDEX);
+    lua_settop(L, 2);
+  }
+  else {
+    lua_Number step = luaL_optnumber(L, 2, LINEINDEXSTEP);
+    LineIndex *ix;
+    luaL_argcheck(L, step >= 1, 2, "positive step expected");
+    lua_settop(L, 1);
+    ix = newindex(L, (l_lineoff)step);
+    if (!buildindex(f, ix))
+      return luaL_fileresult(L, 0, NULL);
+  }
+  lua_getfield(L, LUA_REGISTRYINDEX, LINEINDEXES);
+  lua_pushvalue(L, 1);
+  lua_pushvalue(L, 2);
+  lua_rawset(L, -3);
+  lua_pop(L, 1);
+  return 1;
+}
+
+
+/*
+** file:line(n): returns line n (without its newline), or nil past the last
+** line indexed. Leaves the file positioned after that line.
+*/
+static int f_line (lua_State *L) {
+  FILE *f = tofile(L);
+  l_lineoff n = checklineno(L, 2);
+  LineIndex *ix = fileindex(L, f);
+  if (!seekline(L, f, ix, n) || !read_line(L, f, 1)) {
+    if (ferror(f))
+      return luaL_fileresult(L, 0, NULL);
+    lua_pushnil(L);
+  }
+  return 1;
+}
+
+
+/* upvalue[1]=file; upvalue[2]=lines left */
+static int linerange_iter (lua_State *L) {
+  FILE *f = *(FILE **)lua_touserdata(L, lua_upvalueindex(1));
+  lua_Number left = lua_tonumber(L, lua_upvalueindex(2));
+  if (f == NULL)
+    return luaL_error(L, "file is already closed");
+  if (left <= 0)
+    return 0;
+  lua_pushnumber(L, left - 1);
+  lua_replace(L, lua_upvalueindex(2));
+  clearerr(f);
+  if (!read_line(L, f, 1)) {
+    if (ferror(f))
+      return luaL_error(L, "%s", strerror(errno));
+    return 0;
+  }
+  return 1;
+}
+
+
+/*
+** file:linerange(from, [to]): an iterator over lines from..to (default: to
+** the last line indexed), which seeks once and then reads sequentially.
+*/
+static int f_linerange (lua_State *L) {
+  FILE *f = tofile(L);
+  l_lineoff from = checklineno(L, 2);
+  lua_Number last = luaL_optnumber(L, 3, -1);
+  l_lineoff to;
+  LineIndex *ix;
+  lua_settop(L, 3);
+  ix = fileindex(L, f);
+  to = lua_isnil(L, 3) ? ix->nlines : (l_lineoff)last;
+  if (to > ix->nlines)
+    to = ix->nlines;
+  if (to < from || !seekline(L, f, ix, from))
+    to = from - 1;  /* nothing to iterate */
+  lua_pushvalue(L, 1);
+  lua_pushnumber(L, (lua_Number)(to - from + 1));
+  lua_pushcclosure(L, linerange_iter, 2);
+  return 1;
+}
+
+
+static LineIndex *checkindex (lua_State *L) {
+  return (LineIndex *)luaL_checkudata(L, 1, LINEINDEX);
+}
+
+
+static int ix_count (lua_State *L) {
+  lua_pushnumber(L, (lua_Number)checkindex(L)->nlines);
+  return 1;
+}
+
+
+/* dumps are "LIX1" and then step, nlines, size, n and offs[0..n-1], each as
+   8 bytes little-endian */
+#define DUMPMAGIC	"LIX1"
+
+static void dumpoff (char *p, l_lineoff v) {
+  int i;
+  for (i = 0; i < 8; i++, v >>= 8)
+    p[i] = (char)(v & 0xff);
+}
+
+
+static l_lineoff loadoff (const char *p) {
+  l_lineoff v = 0;
+  int i;
+  for (i = 7; i >= 0; i--)
+    v = (v << 8) | (unsigned char)p[i];
+  return v;
+}
+
+
+/* index:dump(): the index as a string, for io.lineindex */
+static int ix_dump (lua_State *L) {
+  LineIndex *ix = checkindex(L);
+  size_t len = 4 + 8 * (4 + ix->n), i;
+  char *p = (char *)lua_newuserdata(L, len);
+  memcpy(p, DUMPMAGIC, 4);
+  dumpoff(p + 4, ix->step);
+  dumpoff(p + 12, ix->nlines);
+  dumpoff(p + 20, ix->size);
+  dumpoff(p + 28, (l_lineoff)ix->n);
+  for (i = 0; i < ix->n; i++)
+    dumpoff(p + 36 + 8 * i, ix->offs[i]);
+  lua_pushlstring(L, p, len);
+  return 1;
+}
+
+
+/* io.lineindex(s): rebuilds an index from index:dump() */
+static int io_lineindex (lua_State *L) {
+  size_t len, i, n;
+  const char *s = luaL_checklstring(L, 1, &len);
+  LineIndex *ix;
+  if (len < 36 || memcmp(s, DUMPMAGIC, 4) != 0 ||
+      (n = (size_t)loadoff(s + 28)) != (len - 36) / 8 ||
+      (len - 36) % 8 != 0 || n == 0 || loadoff(s + 4) < 1)
+    return luaL_argerror(L, 1, "not a line index dump");
+  ix = newindex(L, loadoff(s + 4));
+  ix->nlines = loadoff(s + 12);
+  ix->size = loadoff(s + 20);
+  if ((ix->offs = (l_lineoff *)malloc(n * sizeof(l_lineoff))) == NULL)
+    return luaL_error(L, "not enough memory");
+  ix->n = ix->cap = n;
+  for (i = 0; i < n; i++)
+    ix->offs[i] = loadoff(s + 36 + 8 * i);
+  return 1;
+}
+
+
+static int ix_gc (lua_State *L) {
+  LineIndex *ix = checkindex(L);
+  free(ix->offs);
+  ix->offs = NULL;
+  ix->n = ix->cap = 0;
+  return 0;
+}
+
+
+static int ix_tostring (lua_State *L) {
+  LineIndex *ix = checkindex(L);
+  lua_pushfstring(L, "line index (%f lines, every %f)",
+                  (lua_Number)ix->nlines, (lua_Number)ix->step);
+  return 1;
+}
+
+
+static const luaL_Reg lineindex_m[] = {
+  {"count", ix_count},
+  {"dump", ix_dump},
+  {NULL, NULL}
+};
+
+
+/* how read_field's field ended */
+#define FIELD_SEP	0  /* at a separator: more fields follow */
+#define FIELD_EOL	1  /* at end of line */
+#define FIELD_EOF	2  /* at end of file */
+#define FIELD_NONE	3  /* at end of file, before any character */
+
+
+/*
+** Read one field of a delimited record and push it. A field starting with
+** quote (when quote isn't EOF) is quoted as in RFC 4180: separators and
+** newlines inside it are data, and a doubled quote stands for one quote.
+** A "\r\n" line end counts as "\n". Runs of ordinary characters are
+** copied straight out of stdio's buffer.
+*/
+static int read_field (lua_State *L, FILE *f, int sep, int quote) {
+  luaL_Buffer b;
+  int quoted = 0;
+  int status;
+  int c;
+  luaL_buffinit(L, &b);
+  c = getc(f);
+  if (c == EOF)
+    status = FIELD_NONE;
+  else {
+    if (c == quote) {
+      quoted = 1;
+      c = l_getc(f);
+    }
+    for (;;) {
+      const char *p;
+      size_t n, k;
+      if (c == EOF) {
+        status = FIELD_EOF;
+        break;
+      }
+      if (quoted) {
+        if (c == quote) {
+          c = getc(f);
+          if (c != quote) {  /* closing quote; look at c again */
+            quoted = 0;
+            continue;
+          }
+        }
+        luaL_addchar(&b, c);
+        l_lockfile(f);
+        if ((p = readptr(f, &n)) != NULL) {  /* copy up to next quote */
+          const char *e = (const char *)memchr(p, quote, n);
+          k = (e != NULL) ? (size_t)(e - p) : n;
+        }
+        l_unlockfile(f);
+        if (p != NULL) {
+          addblock(&b, p, k);
+          readlocked(f, k);
+        }
+      }
+      else {
+        if (c == sep) {
+          status = FIELD_SEP;
+          break;
+        }
+        else if (c == '\n') {
+          status = FIELD_EOL;
+          break;
+        }
+        else if (c == '\r') {
+          c = getc(f);
+          if (c == '\n') {
+            status = FIELD_EOL;
+            break;
+          }
+          luaL_addchar(&b, '\r');
+          continue;  /* look at c again */
+        }
+        luaL_addchar(&b, c);
+        l_lockfile(f);
+        if ((p = readptr(f, &n)) != NULL) {  /* copy up to next special */
+          for (k = 0; k < n; k++) {
+            int d = (unsigned char)p[k];
+            if (d == sep || d == '\n' || d == '\r')
+              break;
+          }
+        }
+        l_unlockfile(f);
+        if (p != NULL) {
+          addblock(&b, p, k);
+          readlocked(f, k);
+        }
+      }
+      c = getc(f);
+    }
+  }
+  luaL_pushresult(&b);
+  return status;
+}
+
+
+/*
+** upvalue[1]=file; upvalue[2]=separator; upvalue[3]=quote or EOF;
+** upvalue[4]=table to fill, or nil to return the fields
+*/
+static int io_readrecord (lua_State *L) {
+  FILE *f = *(FILE **)lua_touserdata(L, lua_upvalueindex(1));
+  int sep = (int)lua_tointeger(L, lua_upvalueindex(2));
+  int quote = (int)lua_tointeger(L, lua_upvalueindex(3));
+  int intable = !lua_isnil(L, lua_upvalueindex(4));
+  int n = 0;
+  int status;
+  if (f == NULL)  /* file is already closed? */
+    return luaL_error(L, "file is already closed");
+  lua_settop(L, 0);
+  if (intable)
+    lua_pushvalue(L, lua_upvalueindex(4));
+  clearerr(f);
+  do {
+    luaL_checkstack(L, LUA_MINSTACK, "too many fields");
+    status = read_field(L, f, sep, quote);
+    if (status == FIELD_NONE && n == 0) {  /* no more records? */
+      if (ferror(f))
+        return luaL_error(L, "%s", strerror(errno));
+      return 0;
+    }
+    n++;
+    if (intable)
+      lua_rawseti(L, 1, n);
+  } while (status == FIELD_SEP);
+  if (ferror(f))
+    return luaL_error(L, "%s", strerror(errno));
+  if (intable) {
+    int old = (int)lua_objlen(L, 1);
+    for (; old > n; old--) {  /* clear stale fields */
+      lua_pushnil(L);
+      lua_rawseti(L, 1, old);
+    }
+    lua_pushinteger(L, n);
+    return 2;  /* table, number of fields */
+  }
+  return n;
+}
+
+
+static int checkchar (lua_State *L, int arg) {
+  size_t l;
+  const char *s = luaL_checklstring(L, arg, &l);
+  luaL_argcheck(L, l == 1, arg, "single character expected");
+  return (unsigned char)s[0];
+}
+
+
+/*
+** file:records(sep, [quote], [tbl]): iterator over the records of a file
+** of delimited fields, one record per line; yields each record's fields,
+** or fills tbl with them and yields tbl and the number of fields
+*/
+static int f_records (lua_State *L) {
+  int sep, quote = EOF;
+  tofile(L);  /* check that it's a valid file handle */
+  sep = checkchar(L, 2);
+  if (lua_toboolean(L, 3))
+    quote = checkchar(L, 3);
+  luaL_argcheck(L, quote != sep && sep != '\n' && sep != '\r', 2,
+                "invalid separator");
+  if (!lua_isnoneornil(L, 4))
+    luaL_checktype(L, 4, LUA_TTABLE);
+  lua_settop(L, 4);
+  lua_pushvalue(L, 1);
+  lua_pushinteger(L, sep);
+  lua_pushinteger(L, quote);
+  lua_pushvalue(L, 4);
+  lua_pushcclosure(L, io_readrecord, 4);
+  return 1;
+}
+
+
+#ifndef LUA_FIVEQ_PLUS
+extern size_t luaQ_number2str (char *buff, lua_Number n);
+#endif
+
+
+static int f_write (lua_State *L) {
+  FILE *f = tofile(L);
+  int arg = 2;
+  int nargs = lua_gettop(L) - 1;
+  int status = 1;
+#if defined(IO_STATS)
+  double t0 = monotime();
+  IOStats *hs = handlestats(L, 1);
+  lua_Number bytes = 0;
+#endif
+  for (; nargs--; arg++) {
+    if (lua_type(L, arg) == LUA_TNUMBER) {
+      char buff[LUAI_MAXNUMBER2STR];
+      size_t l = luaQ_number2str(buff, lua_tonumber(L, arg));
+      status = status && (fwrite(buff, sizeof(char), l, f) == l);
+#if defined(IO_STATS)
+      bytes += (lua_Number)l;
+#endif
+    }
+    else {
+      size_t l;
+      const char *s = luaL_checklstring(L, arg, &l);
+      status = status && (fwrite(s, sizeof(char), l, f) == l);
+#if defined(IO_STATS)
+      bytes += (lua_Number)l;
+#endif
+    }
+  }
+#if defined(IO_STATS)
+  t0 = monotime() - t0;
+  iostats.writes++;
+  iostats.byteswritten += bytes;
+  iostats.writetime += t0;
+  if (hs != NULL) {
+    hs->writes++;
+    hs->byteswritten += bytes;
+    hs->writetime += t0;
+  }
+#endif
+  if (status) {
+    lua_pushvalue(L, 1);
+    return 1;
+  }
+  else return luaL_fileresult(L, status, NULL);
+}
+
+
+#if defined(LUA_USE_POSIX)
+#include <limits.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#else
+struct iovec {
+  void *iov_base;
+  size_t iov_len;
+};
+#endif
+
+/* fragments gathered per batch by file:writeall */
+#define WRITEALL_IOV	256
+#if defined(IOV_MAX) && IOV_MAX < WRITEALL_IOV
+#undef WRITEALL_IOV
+#define WRITEALL_IOV	IOV_MAX
+#endif
+
+/* batches at least this large skip stdio's buffer and go to writev */
+#if !defined(IO_WRITEVSIZE)
+#define IO_WRITEVSIZE	65536
+#endif
+
+
+/* adds to *done the bytes the file takes, all of them unless it fails */
+static int writebatch (FILE *f, struct iovec *iov, int n, size_t total,
+                       size_t *done) {
+#if defined(LUA_USE_POSIX)
+  int fd = fileno(f);  /* -1 for files made by fopencookie, as "z" ones */
+  if (total >= IO_WRITEVSIZE && fd >= 0) {
+    if (fflush(f) != 0)  /* keep earlier buffered output in order */
+      return 0;
+    while (n > 0) {
+      ssize_t w = writev(fd, iov, n);
+      if (w < 0) {
+        if (errno == EINTR) continue;
+        return 0;  /* EAGAIN too, for a non-blocking file */
+      }
+      *done += (size_t)w;
+      for (; n > 0 && (size_t)w >= iov->iov_len; iov++, n--)
+        w -= (ssize_t)iov->iov_len;
+      if (n > 0) {  /* partial write: resume inside this fragment */
+        iov->iov_base = (char *)iov->iov_base + w;
+        iov->iov_len -= (size_t)w;
+      }
+    }
+    return 1;
+  }
+#else
+  (void)total;
+#endif
+  for (; n > 0; iov++, n--) {
+    size_t w = fwrite(iov->iov_base, sizeof(char), iov->iov_len, f);
+    *done += w;
+    if (w != iov->iov_len)
+      return 0;
+  }
+  return 1;
+}
+
+
+/* writes the strings and numbers t[i..last], formatting numbers as write does */
+static int writefrags (lua_State *L, FILE *f, int t, int i, int last,
+                       size_t *done) {
+  int status = 1;
+  while (status && i <= last) {
+    struct iovec iov[WRITEALL_IOV];
+    char nums[WRITEALL_IOV][LUAI_MAXNUMBER2STR];
+    size_t total = 0;
+    int n = 0;
+    for (; i <= last && n < WRITEALL_IOV; i++, n++) {
+      size_t l;
+      lua_rawgeti(L, t, i);
+      if (lua_type(L, -1) == LUA_TNUMBER) {
+        l = luaQ_number2str(nums[n], lua_tonumber(L, -1));
+        iov[n].iov_base = nums[n];
+      }
+      else if (lua_isstring(L, -1)) {
+        /* the string stays alive in tbl after it's popped; writev only
+           reads it, so dropping const is safe */
+        union { const char *c; void *v; } frag;
+        frag.c = lua_tolstring(L, -1, &l);
+        iov[n].iov_base = frag.v;
+      }
+      else
+        return luaL_error(L, "invalid value (at index %d) in table for "
+                             LUA_QL("writeall"), i);
+      lua_pop(L, 1);
+      iov[n].iov_len = l;
+      total += l;
+    }
+    status = writebatch(f, iov, n, total, done);
+  }
+  return status;
+}
+
+
+/*
+** file:writeall(tbl, [i], [j]): writes the strings and numbers tbl[i..j]
+** (default 1 and #tbl), formatting numbers as write does; returns file.
+** On failure (EAGAIN on a non-blocking file among them) the usual nil,
+** message and errno are followed by the number of bytes the file took.
+*/
+static int f_writeall (lua_State *L) {
+  FILE *f = tofile(L);
+  int i, last, status;
+  size_t done = 0;
+  luaL_checktype(L, 2, LUA_TTABLE);
+  i = luaL_optint(L, 3, 1);
+  last = luaL_opt(L, luaL_checkint, 4, (int)lua_objlen(L, 2));
+  lua_settop(L, 2);
+  status = writefrags(L, f, 2, i, last, &done);
+  if (status) {
+    lua_pushvalue(L, 1);
+    return 1;
+  }
+  else {
+    int n = luaL_fileresult(L, status, NULL);
+    lua_pushnumber(L, (lua_Number)done);
+    return n + 1;
+  }
+}
+
+
+/* --- copying between files --- */
+
+/*
+** On glibc we can see that src's stdio buffer has been drained, so the rest
+** can be moved between descriptors without passing through user space.
+*/
+#if defined(__GLIBC__) && defined(LUA_USE_POSIX)
+#define IO_KERNELCOPY
+#include <sys/sendfile.h>
+#endif
+
+/* largest single request made of the kernel */
+#define COPYCHUNK	((size_t)1 << 30)
+
+/* buffer for copies done through stdio */
+#if !defined(IO_COPYBUFSIZE)
+#define IO_COPYBUFSIZE	(1 << 20)
+#endif
+
+
+/* accepts a file handle, or (when *name is set) a path still to be opened */
+static FILE *copyarg (lua_State *L, int arg, const char **name) {
+  FILE **pf;
+  *name = NULL;
+  if (lua_type(L, arg) == LUA_TSTRING) {
+    *name = lua_tostring(L, arg);
+    return NULL;
+  }
+  pf = (FILE **)luaL_checkudata(L, arg, LUA_FILEHANDLE);
+  if (*pf == NULL)
+    luaL_argerror(L, arg, "attempt to use a closed file");
+  return *pf;
+}
+
+
+#if defined(IO_KERNELCOPY)
+
+/* after moving a descriptor's offset behind stdio's back, resynchronize */
+static void syncoffset (FILE *f) {
+  off_t pos = lseek(fileno(f), 0, SEEK_CUR);
+  if (pos >= 0)
+    fseeko(f, pos, SEEK_SET);
+}
+
+
+/*
+** Copy up to *left bytes (all of src when limited is 0) with
+** copy_file_range, else sendfile. Returns 0 on error, or 1 with *copied
+** updated; a method that fails (or reports end of file) before moving any
+** bytes just hands over to the next one, ending with the stdio loop.
+*/
+static int kernelcopy (int in, int out, int limited, size_t *left,
+                       size_t *copied) {
+  int method;
+#if l_glibcprereq(2, 27)
+  method = 0;
+#else
+  method = 1;
+#endif
+  for (; method < 2; method++) {
+    size_t moved = 0;
+    for (;;) {
+      size_t chunk = (limited && *left < COPYCHUNK) ? *left : COPYCHUNK;
+      ssize_t n;
+      if (chunk == 0)
+        return 1;
+#if l_glibcprereq(2, 27)
+      if (method == 0)
+        n = copy_file_range(in, NULL, out, NULL, chunk, 0);
+      else
+#endif
+        n = sendfile(out, in, NULL, chunk);
+      if (n < 0 && errno == EINTR)
+        continue;
+      if (n <= 0) {
+        if (moved > 0)  /* this method works: real end of file or error */
+          return (n == 0);
+        break;  /* try the next method */
+      }
+      moved += (size_t)n;
+      *copied += (size_t)n;
+      if (limited) *left -= (size_t)n;
+    }
+  }
+  return 1;
+}
+
+#endif
+
+
+static int docopy (FILE *src, FILE *dst, int limited, size_t left,
+                   size_t *copied) {
+  const char *p;
+  size_t n;
+  char *buff;
+  *copied = 0;
+  if ((p = readptr(src, &n)) != NULL) {  /* first what stdio has read */
+    if (limited && n > left) n = left;
+    if (fwrite(p, 1, n, dst) != n)
+      return 0;
+    readinc(src, n);
+    *copied += n;
+    left -= n;
+  }
+#if defined(IO_KERNELCOPY)
+  if ((!limited || left > 0) && readptr(src, &n) == NULL &&
+      fileno(src) >= 0 && fileno(dst) >= 0) {  /* not "z" files */
+    size_t before = *copied;
+    int ok;
+    if (fflush(src) != 0 || fflush(dst) != 0)  /* src: any pending output */
+      return 0;
+    ok = kernelcopy(fileno(src), fileno(dst), limited, &left, copied);
+    if (*copied > before) {
+      syncoffset(src);
+      syncoffset(dst);
+    }
+    if (!ok)
+      return 0;
+  }
+#endif
+  if (limited && left == 0)
+    return 1;
+  if ((buff = (char *)malloc(IO_COPYBUFSIZE)) == NULL) {
+    errno = ENOMEM;
+    return 0;
+  }
+  while (!limited || left > 0) {
+    size_t want = (limited && left < IO_COPYBUFSIZE) ? left : IO_COPYBUFSIZE;
+    n = fread(buff, 1, want, src);
+    if (n > 0 && fwrite(buff, 1, n, dst) != n)
+      break;
+    *copied += n;
+    if (limited) left -= n;
+    if (n < want)
+      break;
+  }
+  free(buff);
+  return !ferror(src) && !ferror(dst);
+}
+
+
+/*
+** io.copy(src, dst, [len]): src and dst are file handles or paths; copies
+** len bytes (default: the rest of src) and returns the number copied.
+*/
+static int io_copy (lua_State *L) {
+  const char *srcname, *dstname;
+  FILE *src = copyarg(L, 1, &srcname);
+  FILE *dst = copyarg(L, 2, &dstname);
+  int limited = !lua_isnoneornil(L, 3);
+  lua_Integer len = luaL_optinteger(L, 3, 0);
+  size_t copied;
+  int ok, en;
+  luaL_argcheck(L, len >= 0, 3, "non-negative length expected");
+  if (srcname != NULL && (src = fopen(srcname, "rb")) == NULL)
+    return luaL_fileresult(L, 0, srcname);
+  if (dstname != NULL && (dst = fopen(dstname, "wb")) == NULL) {
+    en = errno;
+    if (srcname != NULL) fclose(src);
+    errno = en;
+    return luaL_fileresult(L, 0, dstname);
+  }
+  clearerr(src);
+  clearerr(dst);
+  ok = docopy(src, dst, limited, (size_t)len, &copied);
+  en = errno;
+  if (srcname != NULL)
+    fclose(src);
+  if (dstname != NULL && fclose(dst) != 0 && ok) {
+    ok = 0;
+    en = errno;
+  }
+  if (!ok) {
+    errno = en;
+    return luaL_fileresult(L, 0, NULL);
+  }
+  lua_pushnumber(L, (lua_Number)copied);
+  return 1;
+}
+
+
+
+#if defined(LUA_USE_POSIX)
+#include <fcntl.h>
+#include <signal.h>
+#include <spawn.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+/* --- spawning processes --- */
+
+#define PROCESS	"fiveq.os.process"
+#define UNREAPED	"fiveq.os.unreaped"  /* pid -> true, for running orphans */
+
+#if !defined(_GNU_SOURCE)
+extern char **environ;
+#endif
+
+typedef struct Process {
+  pid_t pid;
+  int status;
+  int waited;
+} Process;
+
+
+static Process *toprocess (lua_State *L) {
+  return (Process *)luaL_checkudata(L, 1, PROCESS);
+}
+
+
+/*
+** Reaps, without waiting, children whose process objects were collected
+** while they still ran, so that they don't stay zombies.
+*/
+static void reapunreaped (lua_State *L) {
+  lua_getfield(L, LUA_REGISTRYINDEX, UNREAPED);
+  lua_pushnil(L);
+  while (lua_next(L, -2)) {
+    pid_t pid = (pid_t)lua_tointeger(L, -2);
+    int status;
+    lua_pop(L, 1);
+    if (waitpid(pid, &status, WNOHANG) != 0) {  /* reaped, or not ours */
+      lua_pushvalue(L, -1);
+      lua_pushnil(L);
+      lua_rawset(L, -4);  /* clearing a field is allowed during lua_next */
+    }
+  }
+  lua_pop(L, 1);
+}
+
+
+#if !defined(__linux__)
+static int setcloexec (int fd) {
+  int flags = fcntl(fd, F_GETFD);
+  return (flags < 0) ? -1 : fcntl(fd, F_SETFD, flags | FD_CLOEXEC);
+}
+#endif
+
+
+/* a pipe whose ends both close on exec; the child gets its end by dup2 */
+static int cloexecpipe (int fds[2]) {
+#if defined(__linux__)
+  return pipe2(fds, O_CLOEXEC);
+#else
+  if (pipe(fds) != 0)
+    return -1;
+  if (setcloexec(fds[0]) != 0 || setcloexec(fds[1]) != 0) {
+    int en = errno;
+    close(fds[0]);
+    close(fds[1]);
+    errno = en;
+    return -1;
+  }
+  return 0;
+#endif
+}
+
+
+/* what a child's standard stream is set to */
+enum { STREAM_INHERIT, STREAM_NULL, STREAM_PIPE, STREAM_STDOUT, STREAM_FILE };
+
+
+/*
+** Checks opts[name], for the child's descriptor target, and returns its
+** kind: nil inherits, "null" is /dev/null, "pipe" makes a pipe whose other
+** end becomes a Lua file, a file handle is shared, and for stderr "stdout"
+** merges it with standard output. This runs before any spawn action or
+** pipe exists, so that its errors leak nothing; for a pipe it also makes
+** the (closed) handle, in the table at stack index files.
+*/
+static int checkstream (lua_State *L, int opts, int files, const char *name,
+                        int target) {
+  static const char *const kinds[] = {"null", "pipe", "stdout", NULL};
+  int kind;
+  lua_getfield(L, opts, name);
+  if (lua_isnil(L, -1))
+    kind = STREAM_INHERIT;
+  else if (lua_type(L, -1) != LUA_TSTRING) {
+    FILE **pf = (FILE **)luaL_testudata(L, -1, LUA_FILEHANDLE);
+    if (pf == NULL)
+      luaL_argerror(L, opts, lua_pushfstring(L, "file or string expected "
+                                             "for " LUA_QS, name));
+    if (*pf == NULL)
+      luaL_error(L, "attempt to use a closed file for " LUA_QS, name);
+    kind = STREAM_FILE;
+  }
+  else {
+    const char *s = lua_tostring(L, -1);
+    int i;
+    for (i = 0; kinds[i] != NULL && strcmp(kinds[i], s) != 0; i++)
+      ;
+    if (kinds[i] == NULL)
+      luaL_argerror(L, opts, lua_pushfstring(L, "invalid " LUA_QS " option "
+                                             LUA_QS, name, s));
+    kind = STREAM_NULL + i;
+    if (kind == STREAM_STDOUT && target != 2)
+      luaL_error(L, "only stderr can be " LUA_QL("stdout"));
+    if (kind == STREAM_PIPE) {
+      newfile(L);
+      lua_setfield(L, files, name);
+    }
+  }
+  lua_pop(L, 1);
+  return kind;
+}
+
+
+/*
+** Sets up the child's descriptor target as checkstream found it should
+** be. Raises no errors; returns 0 or an errno value.
+*/
+static int spawnstream (lua_State *L, int opts, int files, const char *name,
+                        int kind, int target, posix_spawn_file_actions_t *fa,
+                        int *ours, int *theirs) {
+  switch (kind) {
+    case STREAM_NULL:
+      return posix_spawn_file_actions_addopen(fa, target, "/dev/null",
+                 (target == 0) ? O_RDONLY : O_WRONLY, 0);
+    case STREAM_STDOUT:
+      return posix_spawn_file_actions_adddup2(fa, 1, 2);
+    case STREAM_FILE: {
+      FILE *f;
+      lua_getfield(L, opts, name);
+      f = *(FILE **)lua_touserdata(L, -1);
+      lua_pop(L, 1);
+      fflush(f);
+      return posix_spawn_file_actions_adddup2(fa, fileno(f), target);
+    }
+    case STREAM_PIPE: {
+      int fds[2], mine = (target == 0);  /* we write to the child's stdin */
+      FILE **pf;
+      lua_getfield(L, files, name);
+      pf = (FILE **)lua_touserdata(L, -1);
+      lua_pop(L, 1);
+      if (cloexecpipe(fds) != 0)
+        return errno;
+      *ours = fds[mine];
+      *theirs = fds[!mine];
+      if ((*pf = fdopen(*ours, mine ? "w" : "r")) == NULL)
+        return errno;
+      return posix_spawn_file_actions_adddup2(fa, *theirs, target);
+    }
+    default:
+      return 0;
+  }
+}
+
+
+/* collects the strings tbl[1..n] into a NULL-terminated array */
+static char **strarray (lua_State *L, int tbl, int n, const char *what) {
+  char **a = (char **)lua_newuserdata(L, (size_t)(n + 1) * sizeof(char *));
+  int i;
+  for (i = 0; i < n; i++) {
+    const char *s;
+    lua_rawgeti(L, tbl, i + 1);
+    if (lua_type(L, -1) != LUA_TSTRING)
+      luaL_error(L, "%s entries must be strings", what);
+    /* the string stays alive in tbl after it's popped */
+    s = lua_tostring(L, -1);
+    a[i] = (char *)(size_t)s;
+    lua_pop(L, 1);
+  }
+  a[n] = NULL;
+  return a;
+}
+
+
+/*
+** os.spawn(argv, [opts]): runs argv[1] (searched in PATH) with arguments
+** argv[2..], or with opts.shell runs the command string argv via /bin/sh.
+** opts may also give env (a table of names to values, replacing the
+** environment), cwd, and stdin, stdout, stderr (see spawnstream). Returns
+** a process object, whose pid, stdin, stdout and stderr fields hold the
+** process id and any pipe ends.
+*/
+static int os_spawn (lua_State *L) {
+  static const char *const names[] = {"stdin", "stdout", "stderr"};
+  int opts = lua_isnoneornil(L, 2) ? 0 : 2;
+  int ours[3] = {-1, -1, -1}, theirs[3] = {-1, -1, -1};
+  int kinds[3] = {STREAM_INHERIT, STREAM_INHERIT, STREAM_INHERIT};
+  const char *cwd = NULL;
+  char **argv, **envp = environ;
+  posix_spawn_file_actions_t fa;
+  posix_spawnattr_t attr;
+  Process *p;
+  pid_t pid;
+  int err = 0, i;
+  if (opts) luaL_checktype(L, 2, LUA_TTABLE);
+  lua_settop(L, 2);
+  reapunreaped(L);
+  lua_newtable(L);  /* 3: scratch strings */
+  lua_newtable(L);  /* 4: fields of the process object */
+  if (opts) lua_getfield(L, 2, "shell");
+  else lua_pushnil(L);
+  if (lua_toboolean(L, -1)) {
+    luaL_checkstring(L, 1);
+    lua_createtable(L, 3, 0);
+    lua_pushliteral(L, "/bin/sh");
+    lua_rawseti(L, -2, 1);
+    lua_pushliteral(L, "-c");
+    lua_rawseti(L, -2, 2);
+    lua_pushvalue(L, 1);
+    lua_rawseti(L, -2, 3);
+    lua_replace(L, 1);
+  }
+  lua_pop(L, 1);
+  luaL_checktype(L, 1, LUA_TTABLE);
+  luaL_argcheck(L, lua_objlen(L, 1) > 0, 1, "program name expected");
+  argv = strarray(L, 1, (int)lua_objlen(L, 1), "argv");
+  lua_rawseti(L, 3, 1);  /* keep argv alive */
+  if (opts) {
+    lua_getfield(L, 2, "env");
+    if (!lua_isnil(L, -1)) {
+      int n = 0;
+      luaL_checktype(L, -1, LUA_TTABLE);
+      lua_newtable(L);
+      lua_pushnil(L);
+      while (lua_next(L, -3)) {
+        /* a number key must not be converted in place under lua_next */
+        if (lua_type(L, -2) != LUA_TSTRING)
+          luaL_argerror(L, 2, "env names must be strings");
+        if (!lua_isstring(L, -1))
+          luaL_argerror(L, 2, "env values must be strings");
+        lua_pushfstring(L, "%s=%s", lua_tostring(L, -2), lua_tostring(L, -1));
+        lua_rawseti(L, -4, ++n);
+        lua_pop(L, 1);
+      }
+      envp = strarray(L, lua_gettop(L), n, "env");
+      lua_rawseti(L, 3, 2);
+      lua_rawseti(L, 3, 3);  /* keep the name=value strings alive */
+    }
+    lua_pop(L, 1);
+    for (i = 0; i < 3; i++)
+      kinds[i] = checkstream(L, 2, 4, names[i], i);
+    lua_getfield(L, 2, "cwd");
+    if (!lua_isnil(L, -1)) {
+      if (lua_type(L, -1) != LUA_TSTRING)
+        luaL_argerror(L, 2, "cwd must be a string");
+      cwd = lua_tostring(L, -1);  /* stays alive in opts */
+    }
+    lua_pop(L, 1);
+  }
+  /* nothing below raises errors until fa and attr are destroyed */
+  posix_spawn_file_actions_init(&fa);
+  posix_spawnattr_init(&attr);
+#if defined(POSIX_SPAWN_USEVFORK)
+  posix_spawnattr_setflags(&attr, POSIX_SPAWN_USEVFORK);
+#endif
+  for (i = 0; i < 3 && err == 0; i++)
+    err = spawnstream(L, 2, 4, names[i], kinds[i], i, &fa, &ours[i],
+                      &theirs[i]);
+  if (err == 0 && cwd != NULL) {
+#if l_glibcprereq(2, 29)
+    err = posix_spawn_file_actions_addchdir_np(&fa, cwd);
+#else
+    err = ENOSYS;
+#endif
+  }
+  if (err == 0)
+    err = posix_spawnp(&pid, argv[0], &fa, &attr, argv, envp);
+  posix_spawn_file_actions_destroy(&fa);
+  posix_spawnattr_destroy(&attr);
+  for (i = 0; i < 3; i++) {
+    if (theirs[i] >= 0)
+      close(theirs[i]);  /* the child has its own copy now */
+  }
+  if (err != 0) {
+    for (i = 0; i < 3; i++) {  /* close any pipe ends we made */
+      FILE **pf;
+      lua_getfield(L, 4, names[i]);
+      pf = (FILE **)lua_touserdata(L, -1);
+      if (pf != NULL && *pf != NULL) {
+        fclose(*pf);
+        *pf = NULL;
+        ours[i] = -1;
+      }
+      if (ours[i] >= 0)
+        close(ours[i]);
+      lua_pop(L, 1);
+    }
+    errno = err;
+    return luaL_fileresult(L, 0, argv[0]);
+  }
+  lua_pushinteger(L, (lua_Integer)pid);
+  lua_setfield(L, 4, "pid");
+  p = (Process *)lua_newuserdata(L, sizeof(Process));
+  p->pid = pid;
+  p->status = 0;
+  p->waited = 0;
+  luaL_getmetatable(L, PROCESS);
+  lua_setmetatable(L, -2);
+  lua_pushvalue(L, 4);
+  lua_setuservalue(L, -2);
+  return 1;
+}
+
+
+/* p:wait(): waits for the process to end; returns as os.execute does */
+static int p_wait (lua_State *L) {
+  Process *p = toprocess(L);
+  if (!p->waited) {
+    while (waitpid(p->pid, &p->status, 0) < 0) {
+      if (errno != EINTR)
+        return luaL_fileresult(L, 0, NULL);
+    }
+    p->waited = 1;
+  }
+  return luaL_execresult(L, p->status);
+}
+
+
+/* p:kill([sig]): sends sig (default SIGTERM) unless the process was reaped */
+static int p_kill (lua_State *L) {
+  Process *p = toprocess(L);
+  int sig = luaL_optint(L, 2, SIGTERM);
+  if (p->waited) {
+    errno = ESRCH;
+    return luaL_fileresult(L, 0, NULL);
+  }
+  return luaL_fileresult(L, kill(p->pid, sig) == 0, NULL);
+}
+
+
+/* methods first, then the fields stored in the uservalue */
+static int p_index (lua_State *L) {
+  toprocess(L);
+  lua_pushvalue(L, 2);
+  lua_rawget(L, lua_upvalueindex(1));
+  if (lua_isnil(L, -1)) {
+    lua_getuservalue(L, 1);
+    lua_pushvalue(L, 2);
+    lua_rawget(L, -2);
+  }
+  return 1;
+}
+
+
+/* reap a finished process nobody waited for, so it doesn't linger */
+static int p_gc (lua_State *L) {
+  Process *p = toprocess(L);
+  if (!p->waited && waitpid(p->pid, &p->status, WNOHANG) == 0) {
+    lua_getfield(L, LUA_REGISTRYINDEX, UNREAPED);  /* still running */
+    lua_pushboolean(L, 1);
+    lua_rawseti(L, -2, (int)p->pid);
+    lua_pop(L, 1);
+  }
+  p->waited = 1;
+  return 0;
+}
+
+
+static int p_tostring (lua_State *L) {
+  Process *p = toprocess(L);
+  lua_pushfstring(L, "process (%d)", (int)p->pid);
+  return 1;
+}
+
+
+static const luaL_Reg process_m[] = {
+  {"kill", p_kill},
+  {"wait", p_wait},
+  {NULL, NULL}
+};
+
+#endif
+
+#if defined(LUA_USE_POSIX)
+#include <sys/socket.h>
+
+/* --- non-blocking descriptors, pipes and socket pairs --- */
+
+/* file:nonblock([on=true]): sets or clears O_NONBLOCK; returns file */
+static int f_nonblock (lua_State *L) {
+  int fd = fileno(tofile(L));
+  int on = lua_isnoneornil(L, 2) || lua_toboolean(L, 2);
+  int flags = fcntl(fd, F_GETFL);
+  if (flags < 0 ||
+      fcntl(fd, F_SETFL, on ? (flags | O_NONBLOCK) : (flags & ~O_NONBLOCK)) < 0)
+    return luaL_fileresult(L, 0, NULL);
+  lua_pushvalue(L, 1);
+  return 1;
+}
+
+
+/* wraps two descriptors as files; on failure closes whatever is left */
+static int pushpair (lua_State *L, int fds[2], const char *m0,
+                     const char *m1) {
+  FILE **p0 = newfile(L);
+  FILE **p1 = newfile(L);
+  if ((*p0 = fdopen(fds[0], m0)) == NULL) {
+    int en = errno;
+    close(fds[0]);
+    close(fds[1]);
+    errno = en;
+    return luaL_fileresult(L, 0, NULL);
+  }
+  if ((*p1 = fdopen(fds[1], m1)) == NULL) {
+    int en = errno;
+    close(fds[1]);  /* fds[0] is closed with its handle */
+    errno = en;
+    return luaL_fileresult(L, 0, NULL);
+  }
+  return 2;
+}
+
+
+/* io.pipe(): returns the read and write ends of a new pipe */
+static int io_pipe (lua_State *L) {
+  int fds[2];
+  if (cloexecpipe(fds) != 0)
+    return luaL_fileresult(L, 0, NULL);
+  return pushpair(L, fds, "r", "w");
+}
+
+
+/* io.socketpair(): returns two connected Unix-domain stream sockets */
+static int io_socketpair (lua_State *L) {
+  int fds[2];
+#if defined(SOCK_CLOEXEC)
+  if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, fds) != 0)
+    return luaL_fileresult(L, 0, NULL);
+#else
+  if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) != 0)
+    return luaL_fileresult(L, 0, NULL);
+  setcloexec(fds[0]);
+  setcloexec(fds[1]);
+#endif
+  return pushpair(L, fds, "r+", "r+");
+}
+
+#endif
+
+
+#if defined(__linux__) && defined(LUA_USE_POSIX)
+#define IO_LOOP
+#include <sys/epoll.h>
+
+/* --- an epoll loop running coroutines --- */
+
+#define LOOP	"fiveq.io.loop"
+
+/* most bytes loop:read returns by default */
+#define LOOPCHUNK	65536
+
+/* events taken per epoll_wait */
+#define LOOPEVENTS	64
+
+#define NOSLOT	((size_t)-1)
+
+enum { OP_READ, OP_WRITE, OP_SLEEP };
+
+/* what a suspended task is waiting for */
+typedef struct Op {
+  int kind;
+  int fd;
+  int co;  /* ref of the task in the loop's uservalue */
+  int str;  /* OP_WRITE: ref of the string being written */
+  const char *s;  /* OP_WRITE: what is left of it */
+  size_t n;  /* OP_READ: most bytes to return; OP_WRITE: bytes left */
+  double deadline;  /* 0 for none */
+  size_t slot;  /* index in the timer heap, or NOSLOT */
+} Op;
+
+typedef struct Loop {
+  int epfd;  /* -1 once collected */
+  lua_State *running;  /* task being resumed, or NULL */
+  int runref;  /* its ref */
+  int registered;  /* did the running task leave an Op? */
+  size_t nops;
+  int nfds;  /* size of rd, wr and mask */
+  Op **rd, **wr;  /* per descriptor */
+  int *mask;  /* per descriptor: events given to epoll */
+  Op **heap;  /* timers, earliest first */
+  size_t nheap, heapcap;
+  int *ready;  /* refs of tasks to resume, from rhead to nready */
+  size_t rhead, nready, readycap;
+} Loop;
+
+
+static Loop *checkloop (lua_State *L) {
+  return (Loop *)luaL_checkudata(L, 1, LOOP);
+}
+
+
+/* the loop's read, write and sleep only work inside its tasks */
+static Loop *checkrunning (lua_State *L, const char *what) {
+  Loop *lp = checkloop(L);
+  if (lp->running != L)
+    luaL_error(L, "loop:%s called outside the loop's tasks", what);
+  return lp;
+}
+
+
+static void *growarray (lua_State *L, void *a, size_t n, size_t size) {
+  void *b = realloc(a, n * size);
+  if (b == NULL)
+    luaL_error(L, "not enough memory");
+  return b;
+}
+
+
+static void growfds (lua_State *L, Loop *lp, int fd) {
+  if (fd >= lp->nfds) {
+    int n = (fd < 64) ? 64 : 2 * fd;
+    lp->rd = (Op **)growarray(L, lp->rd, (size_t)n, sizeof(Op *));
+    lp->wr = (Op **)growarray(L, lp->wr, (size_t)n, sizeof(Op *));
+    lp->mask = (int *)growarray(L, lp->mask, (size_t)n, sizeof(int));
+    for (; lp->nfds < n; lp->nfds++) {
+      lp->rd[lp->nfds] = lp->wr[lp->nfds] = NULL;
+      lp->mask[lp->nfds] = 0;
+    }
+  }
+}
+
+
+/* tell epoll which events the ops on fd wait for */
+static int setinterest (Loop *lp, int fd) {
+  struct epoll_event ev;
+  int old = lp->mask[fd];
+  int mask = (lp->rd[fd] ? EPOLLIN : 0) | (lp->wr[fd] ? EPOLLOUT : 0);
+  if (mask == old)
+    return 0;
+  lp->mask[fd] = mask;
+  if (mask == 0) {
+    epoll_ctl(lp->epfd, EPOLL_CTL_DEL, fd, &ev);  /* may be closed already */
+    return 0;
+  }
+  ev.events = (unsigned)mask;
+  ev.data.fd = fd;
+  if (epoll_ctl(lp->epfd, old ? EPOLL_CTL_MOD : EPOLL_CTL_ADD, fd, &ev) == 0)
+    return 0;
+  if (errno == ENOENT || errno == EEXIST)  /* closed and reused, or stale */
+    if (epoll_ctl(lp->epfd, old ? EPOLL_CTL_ADD : EPOLL_CTL_MOD, fd, &ev) == 0)
+      return 0;
+  lp->mask[fd] = 0;
+  return -1;
+}
+
+
+/* {====== timer heap */
+
+#define heapset(lp,i,op)	((lp)->heap[i] = (op), (op)->slot = (i))
+
+static void heapup (Loop *lp, size_t i) {
+  Op *op = lp->heap[i];
+  while (i > 0 && lp->heap[(i - 1) / 2]->deadline > op->deadline) {
+    heapset(lp, i, lp->heap[(i - 1) / 2]);
+    i = (i - 1) / 2;
+  }
+  heapset(lp, i, op);
+}
+
+
+static void heapdown (Loop *lp, size_t i) {
+  Op *op = lp->heap[i];
+  for (;;) {
+    size_t c = 2 * i + 1;
+    if (c >= lp->nheap) break;
+    if (c + 1 < lp->nheap && lp->heap[c + 1]->deadline < lp->heap[c]->deadline)
+      c++;
+    if (lp->heap[c]->deadline >= op->deadline) break;
+    heapset(lp, i, lp->heap[c]);
+    i = c;
+  }
+  heapset(lp, i, op);
+}
+
+
+static void heapinsert (lua_State *L, Loop *lp, Op *op) {
+  if (lp->nheap == lp->heapcap) {
+    lp->heapcap = lp->heapcap ? 2 * lp->heapcap : 16;
+    lp->heap = (Op **)growarray(L, lp->heap, lp->heapcap, sizeof(Op *));
+  }
+  heapset(lp, lp->nheap, op);
+  heapup(lp, lp->nheap++);
+}
+
+
+static void heapremove (Loop *lp, Op *op) {
+  size_t i = op->slot;
+  op->slot = NOSLOT;
+  if (i == NOSLOT) return;
+  if (i != --lp->nheap) {  /* move the last timer into the hole */
+    Op *last = lp->heap[lp->nheap];
+    heapset(lp, i, last);
+    heapup(lp, i);
+    heapdown(lp, last->slot);
+  }
+}
+
+/* }====== */
+
+
+static void pushready (lua_State *L, Loop *lp, int ref) {
+  if (lp->nready == lp->readycap) {
+    if (lp->rhead > 0) {  /* reuse the space of tasks already taken */
+      memmove(lp->ready, lp->ready + lp->rhead,
+              (lp->nready - lp->rhead) * sizeof(int));
+      lp->nready -= lp->rhead;
+      lp->rhead = 0;
+    }
+    else {
+      lp->readycap = lp->readycap ? 2 * lp->readycap : 16;
+      lp->ready = (int *)growarray(L, lp->ready, lp->readycap, sizeof(int));
+    }
+  }
+  lp->ready[lp->nready++] = ref;
+}
+
+
+/* records that the running task waits for op (with timeout, if >= 0) */
+static Op *newop (lua_State *L, Loop *lp, int kind, int fd, double timeout) {
+  Op *op = (Op *)malloc(sizeof(Op));
+  if (op == NULL)
+    luaL_error(L, "not enough memory");
+  op->kind = kind;
+  op->fd = fd;
+  op->co = lp->runref;
+  op->str = LUA_NOREF;
+  op->s = NULL;
+  op->n = 0;
+  op->deadline = 0;
+  op->slot = NOSLOT;
+  if (timeout >= 0) {
+    op->deadline = monotime() + timeout;
+    heapinsert(L, lp, op);
+  }
+  lp->registered = 1;
+  lp->nops++;
+  return op;
+}
+
+
+/* forgets op; the task's ref now belongs to the caller */
+static void dropop (lua_State *L, int uv, Loop *lp, Op *op) {
+  heapremove(lp, op);
+  if (op->kind == OP_READ && lp->rd[op->fd] == op) {
+    lp->rd[op->fd] = NULL;
+    setinterest(lp, op->fd);
+  }
+  else if (op->kind == OP_WRITE && lp->wr[op->fd] == op) {
+    lp->wr[op->fd] = NULL;
+    setinterest(lp, op->fd);
+  }
+  luaL_unref(L, uv, op->str);
+  lp->nops--;
+  free(op);
+}
+
+
+/* resumes task ref with the narg values on top of co; rethrows its errors */
+static void resumetask (lua_State *L, int uv, Loop *lp, int ref, lua_State *co,
+                        int narg) {
+  int status;
+  lp->running = co;
+  lp->runref = ref;
+  lp->registered = 0;
+  status = lua_resume(co, narg);
+  lp->running = NULL;
+  if (status == LUA_YIELD) {
+    if (!lp->registered)  /* yielded for its own reasons: run it again */
+      pushready(L, lp, ref);
+    return;
+  }
+  if (status != 0)
+    lua_xmove(co, L, 1);  /* error message */
+  luaL_unref(L, uv, ref);
+  if (status != 0)
+    lua_error(L);
+}
+
+
+/* ends op with the nres values on top of L, and resumes its task */
+static void completeop (lua_State *L, int uv, Loop *lp, Op *op, int nres) {
+  int ref = op->co;
+  lua_State *co;
+  lua_rawgeti(L, uv, ref);
+  co = lua_tothread(L, -1);
+  lua_pop(L, 1);  /* still anchored by ref */
+  dropop(L, uv, lp, op);
+  lua_xmove(L, co, nres);
+  resumetask(L, uv, lp, ref, co, nres);
+}
+
+
+/*
+** Reads up to n bytes, returning as soon as some have arrived. Pushes the
+** data, nil at end of file, or nil, message, errno, and returns how many
+** values it pushed; 0 means it would block.
+*/
+static int tryread (lua_State *L, int fd, size_t n) {
+  luaL_Buffer b;
+  size_t got = 0;
+  int en = 0;
+  luaL_buffinit(L, &b);
+  while (got < n) {
+    size_t want = (n - got < LUAL_BUFFERSIZE) ? n - got : LUAL_BUFFERSIZE;
+    ssize_t r = read(fd, luaL_prepbuffer(&b), want);
+    if (r < 0 && errno == EINTR)
+      continue;
+    if (r <= 0) {
+      en = (r < 0) ? errno : 0;
+      break;
+    }
+    luaL_addsize(&b, (size_t)r);
+    got += (size_t)r;
+    if ((size_t)r < want)
+      break;
+  }
+  luaL_pushresult(&b);
+  if (got > 0)
+    return 1;  /* any error shows up on the next read */
+  lua_pop(L, 1);
+  if (en == EAGAIN || en == EWOULDBLOCK)
+    return 0;
+  if (en == 0) {
+    lua_pushnil(L);  /* end of file */
+    return 1;
+  }
+  errno = en;
+  return luaL_fileresult(L, 0, NULL);
+}
+
+
+/* writes what it can of op's string; as tryread, 0 means it would block */
+static int trywrite (lua_State *L, int fd, Op *op) {
+  while (op->n > 0) {
+    ssize_t w = write(fd, op->s, op->n);
+    if (w < 0) {
+      if (errno == EINTR) continue;
+      if (errno == EAGAIN || errno == EWOULDBLOCK) return 0;
+      return luaL_fileresult(L, 0, NULL);
+    }
+    op->s += w;
+    op->n -= (size_t)w;
+  }
+  lua_pushboolean(L, 1);
+  return 1;
+}
+
+
+static int setnonblock (int fd) {
+  int flags = fcntl(fd, F_GETFL);
+  if (flags < 0) return -1;
+  return (flags & O_NONBLOCK) ? 0 : fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+
+static FILE *tofileat (lua_State *L, int arg) {
+  FILE **pf = (FILE **)luaL_checkudata(L, arg, LUA_FILEHANDLE);
+  if (*pf == NULL)
+    luaL_error(L, "attempt to use a closed file");
+  return *pf;
+}
+
+
+static double opttimeout (lua_State *L, int arg) {
+  lua_Number t = luaL_optnumber(L, arg, -1);
+  luaL_argcheck(L, lua_isnoneornil(L, arg) || t >= 0, arg,
+                "non-negative timeout expected");
+  return (double)t;
+}
+
+
+/* io.loop(): a new, empty loop */
+static int io_loop (lua_State *L) {
+  Loop *lp = (Loop *)lua_newuserdata(L, sizeof(Loop));
+  memset(lp, 0, sizeof(Loop));
+  lp->epfd = -1;
+  luaL_getmetatable(L, LOOP);
+  lua_setmetatable(L, -2);
+  lua_newtable(L);  /* refs of tasks and of strings being written */
+  lua_setuservalue(L, -2);
+  if ((lp->epfd = epoll_create1(EPOLL_CLOEXEC)) < 0)
+    return luaL_fileresult(L, 0, NULL);
+  return 1;
+}
+
+
+/* loop:spawn(fn, ...): adds a task calling fn(...); returns its coroutine */
+static int loop_spawn (lua_State *L) {
+  Loop *lp = checkloop(L);
+  int n = lua_gettop(L), i;
+  lua_State *co;
+  luaL_checktype(L, 2, LUA_TFUNCTION);
+  lua_getuservalue(L, 1);
+  co = lua_newthread(L);
+  for (i = 2; i <= n; i++)
+    lua_pushvalue(L, i);
+  lua_xmove(L, co, n - 1);
+  lua_pushvalue(L, -1);
+  pushready(L, lp, luaL_ref(L, n + 1));
+  return 1;
+}
+
+
+/*
+** loop:read(file, [n], [timeout]): waits until file has data and returns up
+** to n bytes of it, nil at end of file, nil, "timeout", or nil, message, errno
+*/
+static int loop_read (lua_State *L) {
+  Loop *lp = checkrunning(L, "read");
+  FILE *f = tofileat(L, 2);
+  lua_Integer n = luaL_optinteger(L, 3, LOOPCHUNK);
+  double timeout = opttimeout(L, 4);
+  int fd = fileno(f), nr;
+  const char *p;
+  size_t k;
+  Op *op;
+  luaL_argcheck(L, n > 0, 3, "positive count expected");
+  if ((p = readptr(f, &k)) != NULL) {  /* stdio has some already */
+    if (k > (size_t)n) k = (size_t)n;
+    lua_pushlstring(L, p, k);
+    readinc(f, k);
+    return 1;
+  }
+  if (setnonblock(fd) != 0)
+    return luaL_fileresult(L, 0, NULL);
+  if ((nr = tryread(L, fd, (size_t)n)) != 0)
+    return nr;
+  growfds(L, lp, fd);
+  if (lp->rd[fd] != NULL)
+    return luaL_error(L, "another task is already reading this file");
+  op = newop(L, lp, OP_READ, fd, timeout);
+  op->n = (size_t)n;
+  lp->rd[fd] = op;
+  if (setinterest(lp, fd) != 0) {
+    lua_getuservalue(L, 1);
+    lp->rd[fd] = NULL;
+    dropop(L, lua_gettop(L), lp, op);
+    lp->registered = 0;
+    return luaL_fileresult(L, 0, NULL);
+  }
+  return lua_yield(L, 0);
+}
+
+
+/*
+** loop:write(file, s, [timeout]): writes all of s, waiting whenever file is
+** full; returns true, nil, "timeout", or nil, message, errno
+*/
+static int loop_write (lua_State *L) {
+  Loop *lp = checkrunning(L, "write");
+  FILE *f = tofileat(L, 2);
+  size_t l;
+  const char *s = luaL_checklstring(L, 3, &l);
+  double timeout = opttimeout(L, 4);
+  int fd = fileno(f), nr;
+  Op *op;
+  lua_settop(L, 3);
+  lua_getuservalue(L, 1);  /* 4 */
+  if (fflush(f) != 0 || setnonblock(fd) != 0)
+    return luaL_fileresult(L, 0, NULL);
+  growfds(L, lp, fd);
+  if (lp->wr[fd] != NULL)
+    return luaL_error(L, "another task is already writing this file");
+  op = newop(L, lp, OP_WRITE, fd, timeout);
+  op->s = s;
+  op->n = l;
+  if ((nr = trywrite(L, fd, op)) != 0) {
+    dropop(L, 4, lp, op);
+    lp->registered = 0;
+    return nr;
+  }
+  lua_pushvalue(L, 3);
+  op->str = luaL_ref(L, 4);  /* keep s alive while waiting */
+  lp->wr[fd] = op;
+  if (setinterest(lp, fd) != 0) {
+    lp->wr[fd] = NULL;
+    dropop(L, 4, lp, op);
+    lp->registered = 0;
+    return luaL_fileresult(L, 0, NULL);
+  }
+  return lua_yield(L, 0);
+}
+
+
+/* loop:sleep([secs]): suspends the task for secs, or lets others run first */
+static int loop_sleep (lua_State *L) {
+  Loop *lp = checkrunning(L, "sleep");
+  lua_Number secs = luaL_optnumber(L, 2, 0);
+  if (secs > 0)
+    newop(L, lp, OP_SLEEP, -1, (double)secs);
+  return lua_yield(L, 0);  /* without an op, it is simply requeued */
+}
+
+
+/* loop:now(): seconds on the monotonic clock that timeouts use */
+static int loop_now (lua_State *L) {
+  checkloop(L);
+  lua_pushnumber(L, (lua_Number)monotime());
+  return 1;
+}
+
+
+/*
+** loop:run([timeout]): runs tasks until all have finished (returns true)
+** or timeout seconds have passed (returns false). A task's error ends run
+** with that error.
+*/
+static int loop_run (lua_State *L) {
+  Loop *lp = checkloop(L);
+  double timeout = opttimeout(L, 2);
+  double limit = (timeout >= 0) ? monotime() + timeout : -1;
+  struct epoll_event evs[LOOPEVENTS];
+  if (lp->running != NULL)
+    return luaL_error(L, "loop:run called from one of the loop's tasks");
+  lua_settop(L, 1);
+  lua_getuservalue(L, 1);  /* 2 */
+  for (;;) {
+    size_t k = lp->nready - lp->rhead;
+    double t;
+    int i, nev, ms = -1;
+    while (k-- > 0) {  /* tasks ready at the start of this round */
+      int ref = lp->ready[lp->rhead++];
+      lua_State *co;
+      if (lp->rhead == lp->nready)
+        lp->rhead = lp->nready = 0;
+      lua_rawgeti(L, 2, ref);
+      co = lua_tothread(L, -1);
+      lua_pop(L, 1);
+      resumetask(L, 2, lp, ref, co, (lua_status(co) == 0) ?
+                                    lua_gettop(co) - 1 : 0);
+    }
+    if (lp->nready == lp->rhead && lp->nops == 0) {
+      lua_pushboolean(L, 1);
+      return 1;
+    }
+    t = monotime();
+    if (limit >= 0 && t >= limit) {
+      lua_pushboolean(L, 0);
+      return 1;
+    }
+    if (lp->nready > lp->rhead)
+      ms = 0;
+    else {
+      double until = (lp->nheap > 0) ? lp->heap[0]->deadline : -1;
+      if (limit >= 0 && (until < 0 || limit < until))
+        until = limit;
+      if (until >= 0)
+        ms = (until <= t) ? 0 : (int)((until - t) * 1000 + 0.999);
+    }
+    nev = epoll_wait(lp->epfd, evs, LOOPEVENTS, ms);
+    if (nev < 0 && errno != EINTR)
+      return luaL_fileresult(L, 0, NULL);
+    for (i = 0; i < nev; i++) {
+      int fd = evs[i].data.fd, nr;
+      unsigned ev = evs[i].events;
+      Op *op;
+      if ((ev & (EPOLLIN | EPOLLHUP | EPOLLERR)) && (op = lp->rd[fd]) != NULL &&
+          (nr = tryread(L, fd, op->n)) != 0)
+        completeop(L, 2, lp, op, nr);
+      if (fd < lp->nfds && (ev & (EPOLLOUT | EPOLLHUP | EPOLLERR)) &&
+          (op = lp->wr[fd]) != NULL && (nr = trywrite(L, fd, op)) != 0)
+        completeop(L, 2, lp, op, nr);
+    }
+    t = monotime();
+    while (lp->nheap > 0 && lp->heap[0]->deadline <= t) {  /* expired */
+      Op *op = lp->heap[0];
+      int nr = 0;
+      if (op->kind != OP_SLEEP) {
+        lua_pushnil(L);
+        lua_pushliteral(L, "timeout");
+        nr = 2;
+      }
+      completeop(L, 2, lp, op, nr);
+    }
+  }
+}
+
+
+static int loop_gc (lua_State *L) {
+  Loop *lp = checkloop(L);
+  int fd;
+  size_t i;
+  for (i = 0; i < lp->nheap; i++)  /* sleepers are only in the heap */
+    if (lp->heap[i]->kind == OP_SLEEP) free(lp->heap[i]);
+  for (fd = 0; fd < lp->nfds; fd++) {
+    free(lp->rd[fd]);
+    free(lp->wr[fd]);
+  }
+  free(lp->rd);
+  free(lp->wr);
+  free(lp->mask);
+  free(lp->heap);
+  free(lp->ready);
+  if (lp->epfd >= 0)
+    close(lp->epfd);
+  memset(lp, 0, sizeof(Loop));
+  lp->epfd = -1;
+  return 0;
+}
+
+
+static const luaL_Reg loop_m[] = {
+  {"now", loop_now},
+  {"read", loop_read},
+  {"run", loop_run},
+  {"sleep", loop_sleep},
+  {"spawn", loop_spawn},
+  {"write", loop_write},
+  {NULL, NULL}
+};
+
+#endif
+
+#if defined(LUA_USE_POSIX)
+#include <pthread.h>
+
+/* --- reading many files at once --- */
+
+#if !defined(O_CLOEXEC)
+#define O_CLOEXEC	0
+#endif
+
+/* default size of the thread pool used without io_uring */
+#define READMANYTHREADS	8
+
+typedef struct ReadJob {
+  const char *path;
+  char *data;  /* malloc'd contents */
+  size_t len;  /* bytes read so far */
+  size_t cap;  /* size of data */
+  int fd;
+  int err;  /* errno value, or 0 */
+  int isreg;  /* a regular file: a short read means end of file */
+  int done;
+} ReadJob;
+
+
+/* allocates room for the whole of fd, according to fstat */
+static int sizejob (ReadJob *j, int fd) {
+  struct stat st;
+  if (fstat(fd, &st) != 0)
+    return errno;
+  j->isreg = S_ISREG(st.st_mode);
+  j->cap = (j->isreg ? (size_t)st.st_size : LUAL_BUFFERSIZE) + 1;
+  j->len = 0;
+  if ((j->data = (char *)malloc(j->cap)) == NULL)
+    return ENOMEM;
+  return 0;
+}
+
+
+/* reads the rest of fd, from j->len on */
+static int slurpjob (ReadJob *j, int fd) {
+  for (;;) {
+    ssize_t r;
+    if (j->len == j->cap) {
+      char *p = (char *)realloc(j->data, 2 * j->cap);
+      if (p == NULL)
+        return ENOMEM;
+      j->data = p;
+      j->cap *= 2;
+    }
+    r = read(fd, j->data + j->len, j->cap - j->len);
+    if (r < 0) {
+      if (errno == EINTR) continue;
+      return errno;
+    }
+    j->len += (size_t)r;
+    if (r == 0 || (j->isreg && j->len < j->cap))
+      return 0;
+  }
+}
+
+
+static void readjob (ReadJob *j) {
+  int fd = open(j->path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+    j->err = errno;
+  else {
+    if ((j->err = sizejob(j, fd)) == 0)
+      j->err = slurpjob(j, fd);
+    close(fd);
+  }
+  j->done = 1;
+}
+
+
+typedef struct ReadPool {
+  ReadJob *jobs;
+  size_t n, next;
+  pthread_mutex_t lock;
+} ReadPool;
+
+
+static void *poolworker (void *arg) {
+  ReadPool *pool = (ReadPool *)arg;
+  for (;;) {
+    size_t i;
+    pthread_mutex_lock(&pool->lock);
+    i = pool->next++;
+    pthread_mutex_unlock(&pool->lock);
+    if (i >= pool->n)
+      return NULL;
+    if (!pool->jobs[i].done)
+      readjob(&pool->jobs[i]);
+  }
+}
+
+
+/* reads every job not yet done, with up to nthreads threads */
+static void poolread (ReadJob *jobs, size_t n, int nthreads) {
+  ReadPool pool;
+  pthread_t tids[64];
+  size_t left = 0, k;
+  int i, started = 0;
+  for (k = 0; k < n; k++)
+    left += !jobs[k].done;
+  if (left == 0)  /* the ring read them all */
+    return;
+  pool.jobs = jobs;
+  pool.n = n;
+  pool.next = 0;
+  pthread_mutex_init(&pool.lock, NULL);
+  if (nthreads > 64) nthreads = 64;
+  if ((size_t)nthreads > left) nthreads = (int)left;
+  for (i = 1; i < nthreads; i++) {  /* this thread is the first worker */
+    if (pthread_create(&tids[started], NULL, poolworker, &pool) != 0)
+      break;
+    started++;
+  }
+  poolworker(&pool);
+  for (i = 0; i < started; i++)
+    pthread_join(tids[i], NULL);
+  pthread_mutex_destroy(&pool.lock);
+}
+
+
+/*
+** With io_uring (Linux 5.6 or later), the files are taken a ring's worth
+** at a time: all their opens are submitted together, then (after an
+** fstat each, which is cheap on an open descriptor) all their reads, then
+** all their closes. Files the ring can't handle are left for the pool.
+*/
+#if defined(__linux__) && defined(__GNUC__) && !defined(IO_NO_URING)
+#include <sys/syscall.h>
+#if defined(__NR_io_uring_setup) && defined(__NR_io_uring_enter)
+#define IO_URING
+#include <sys/mman.h>
+#include <linux/io_uring.h>
+#endif
+#endif
+
+#if defined(IO_URING)
+
+#define RINGENTRIES	128
+
+enum { RING_OPEN, RING_READ, RING_CLOSE };
+
+typedef struct Ring {
+  int fd;
+  unsigned entries;
+  unsigned *sqhead, *sqtail, *sqmask, *sqarray;
+  unsigned *cqhead, *cqtail, *cqmask;
+  struct io_uring_sqe *sqes;
+  struct io_uring_cqe *cqes;
+  void *sq, *cq;
+  size_t sqsize, cqsize, sqessize;
+} Ring;
+
+
+#define ringptr(base,off)	((unsigned *)(void *)((char *)(base) + (off)))
+
+static int ringinit (Ring *r) {
+  struct io_uring_params p;
+  memset(&p, 0, sizeof(p));
+  r->fd = (int)syscall(__NR_io_uring_setup, RINGENTRIES, &p);
+  if (r->fd < 0)
+    return -1;
+  r->entries = p.sq_entries;
+  r->sqsize = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+  r->cqsize = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  if (p.features & IORING_FEAT_SINGLE_MMAP) {
+    if (r->cqsize > r->sqsize) r->sqsize = r->cqsize;
+    r->cqsize = r->sqsize;
+  }
+  r->sqessize = p.sq_entries * sizeof(struct io_uring_sqe);
+  r->sq = mmap(NULL, r->sqsize, PROT_READ | PROT_WRITE,
+               MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+  r->cq = (p.features & IORING_FEAT_SINGLE_MMAP) ? r->sq :
+          mmap(NULL, r->cqsize, PROT_READ | PROT_WRITE,
+               MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_CQ_RING);
+  r->sqes = (struct io_uring_sqe *)mmap(NULL, r->sqessize,
+               PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd,
+               IORING_OFF_SQES);
+  if (r->sq == MAP_FAILED || r->cq == MAP_FAILED ||
+      (void *)r->sqes == MAP_FAILED) {
+    if (r->sq != MAP_FAILED) munmap(r->sq, r->sqsize);
+    if (r->cq != MAP_FAILED && r->cq != r->sq) munmap(r->cq, r->cqsize);
+    if ((void *)r->sqes != MAP_FAILED) munmap(r->sqes, r->sqessize);
+    close(r->fd);
+    return -1;
+  }
+  r->sqhead = ringptr(r->sq, p.sq_off.head);
+  r->sqtail = ringptr(r->sq, p.sq_off.tail);
+  r->sqmask = ringptr(r->sq, p.sq_off.ring_mask);
+  r->sqarray = ringptr(r->sq, p.sq_off.array);
+  r->cqhead = ringptr(r->cq, p.cq_off.head);
+  r->cqtail = ringptr(r->cq, p.cq_off.tail);
+  r->cqmask = ringptr(r->cq, p.cq_off.ring_mask);
+  r->cqes = (struct io_uring_cqe *)(void *)((char *)r->cq + p.cq_off.cqes);
+  return 0;
+}
+
+
+static void ringfree (Ring *r) {
+  munmap(r->sqes, r->sqessize);
+  if (r->cq != r->sq) munmap(r->cq, r->cqsize);
+  munmap(r->sq, r->sqsize);
+  close(r->fd);
+}
+
+
+/* does job j take part in the phase? */
+static int ringwants (const ReadJob *j, int phase) {
+  switch (phase) {
+    case RING_OPEN: return !j->done && j->fd < 0;
+    case RING_READ: return !j->done && j->fd >= 0 && j->data != NULL;
+    default: return j->fd >= 0;
+  }
+}
+
+
+static void ringprep (struct io_uring_sqe *sqe, ReadJob *j, int phase) {
+  memset(sqe, 0, sizeof(*sqe));
+  sqe->fd = (phase == RING_OPEN) ? AT_FDCWD : j->fd;
+  switch (phase) {
+    case RING_OPEN:
+      sqe->opcode = IORING_OP_OPENAT;
+      sqe->addr = (unsigned long)j->path;
+      sqe->open_flags = O_RDONLY | O_CLOEXEC;
+      break;
+    case RING_READ:
+      sqe->opcode = IORING_OP_READ;
+      sqe->addr = (unsigned long)j->data;
+      sqe->len = (unsigned)j->cap;
+      sqe->off = (__u64)-1;  /* at the file position, moving it on */
+      break;
+    default:
+      sqe->opcode = IORING_OP_CLOSE;
+      break;
+  }
+}
+
+
+/* records the result of job j's operation in the phase */
+static void ringdone (ReadJob *j, int phase, int res) {
+  int unsupported = (res == -EINVAL || res == -EOPNOTSUPP);
+  switch (phase) {
+    case RING_OPEN:
+      if (res >= 0)
+        j->fd = res;
+      else if (!unsupported) {  /* else the pool opens it later */
+        j->err = -res;
+        j->done = 1;
+      }
+      break;
+    case RING_READ:
+      if (res >= 0) {
+        j->len = (size_t)res;
+        if (j->isreg && j->len < j->cap)  /* all of it */
+          j->done = 1;
+      }
+      else if (!unsupported) {
+        j->err = -res;
+        j->done = 1;
+      }
+      break;
+    default:
+      if (res < 0) close(j->fd);
+      j->fd = -1;
+      break;
+  }
+}
+
+
+/*
+** Runs one phase over jobs[lo..hi), at most a ring's worth in flight.
+** Returns -1 if the ring failed; jobs still in flight then keep their
+** buffers (which are leaked rather than freed under the kernel).
+*/
+static int ringphase (Ring *r, ReadJob *jobs, size_t lo, size_t hi,
+                      int phase) {
+  size_t next = lo;
+  unsigned inflight = 0, unsubmitted = 0;
+  for (;;) {
+    unsigned tail = *r->sqtail, head;
+    int ret;
+    for (; next < hi && inflight < r->entries; next++) {
+      struct io_uring_sqe *sqe;
+      unsigned idx;
+      if (!ringwants(&jobs[next], phase))
+        continue;
+      idx = tail & *r->sqmask;
+      sqe = &r->sqes[idx];
+      ringprep(sqe, &jobs[next], phase);
+      sqe->user_data = next;
+      r->sqarray[idx] = idx;
+      tail++;
+      inflight++;
+      unsubmitted++;
+    }
+    __atomic_store_n(r->sqtail, tail, __ATOMIC_RELEASE);
+    if (inflight == 0)
+      return 0;
+    ret = (int)syscall(__NR_io_uring_enter, r->fd, unsubmitted, 1,
+                       IORING_ENTER_GETEVENTS, NULL, 0);
+    if (ret < 0) {
+      if (errno == EINTR || errno == EAGAIN || errno == EBUSY)
+        continue;
+      for (; lo < hi; lo++)  /* in flight: give up their buffers */
+        if (ringwants(&jobs[lo], phase) && phase == RING_READ)
+          jobs[lo].data = NULL;
+      return -1;
+    }
+    unsubmitted -= (unsigned)ret;
+    head = *r->cqhead;
+    while (head != __atomic_load_n(r->cqtail, __ATOMIC_ACQUIRE)) {
+      struct io_uring_cqe *cqe = &r->cqes[head & *r->cqmask];
+      ringdone(&jobs[cqe->user_data], phase, cqe->res);
+      inflight--;
+      head++;
+    }
+    __atomic_store_n(r->cqhead, head, __ATOMIC_RELEASE);
+  }
+}
+
+
+/* reads what it can through io_uring; returns -1 if there is no ring */
+static int ringread (ReadJob *jobs, size_t n) {
+  Ring r;
+  size_t lo, i;
+  if (ringinit(&r) != 0)
+    return -1;
+  for (lo = 0; lo < n; lo += r.entries) {
+    size_t hi = (n - lo < r.entries) ? n : lo + r.entries;
+    if (ringphase(&r, jobs, lo, hi, RING_OPEN) != 0)
+      break;
+    for (i = lo; i < hi; i++) {
+      ReadJob *j = &jobs[i];
+      if (!j->done && j->fd >= 0 && (j->err = sizejob(j, j->fd)) != 0)
+        j->done = 1;
+    }
+    if (ringphase(&r, jobs, lo, hi, RING_READ) != 0)
+      break;
+    for (i = lo; i < hi; i++) {  /* finish what a single read didn't */
+      ReadJob *j = &jobs[i];
+      if (!j->done && j->fd >= 0) {
+        j->err = slurpjob(j, j->fd);
+        j->done = 1;
+      }
+    }
+    if (ringphase(&r, jobs, lo, hi, RING_CLOSE) != 0)
+      break;
+  }
+  ringfree(&r);
+  for (i = 0; i < n; i++) {  /* leave anything unfinished to the pool */
+    ReadJob *j = &jobs[i];
+    if (j->fd >= 0) {
+      close(j->fd);
+      j->fd = -1;
+    }
+    if (!j->done) {
+      free(j->data);
+      j->data = NULL;
+    }
+  }
+  return 0;
+}
+
+#endif
+
+
+/*
+** io.readmany(paths, [opts]): reads the whole of each file in the array
+** paths. Returns a table holding each file's contents, or false where it
+** couldn't be read, and a table of error messages at those same indices.
+** opts.threads sets the size of the thread pool used without io_uring, and
+** opts.uring = false skips io_uring.
+*/
+static int io_readmany (lua_State *L) {
+  int nthreads = READMANYTHREADS, useuring = 1;
+  size_t n, i;
+  ReadJob *jobs;
+  luaL_checktype(L, 1, LUA_TTABLE);
+  if (!lua_isnoneornil(L, 2)) {
+    luaL_checktype(L, 2, LUA_TTABLE);
+    lua_getfield(L, 2, "threads");
+    nthreads = luaL_optint(L, -1, READMANYTHREADS);
+    luaL_argcheck(L, nthreads > 0, 2, "positive thread count expected");
+    lua_getfield(L, 2, "uring");
+    useuring = lua_isnil(L, -1) || lua_toboolean(L, -1);
+    lua_pop(L, 2);
+  }
+  lua_settop(L, 1);
+  n = lua_objlen(L, 1);
+  jobs = (ReadJob *)lua_newuserdata(L, (n ? n : 1) * sizeof(ReadJob));
+  for (i = 0; i < n; i++) {
+    lua_rawgeti(L, 1, (int)i + 1);
+    if (lua_type(L, -1) != LUA_TSTRING)
+      luaL_error(L, "paths entries must be strings");
+    jobs[i].path = lua_tostring(L, -1);  /* stays alive in paths */
+    lua_pop(L, 1);
+    jobs[i].data = NULL;
+    jobs[i].len = jobs[i].cap = 0;
+    jobs[i].fd = -1;
+    jobs[i].err = 0;
+    jobs[i].isreg = 0;
+    jobs[i].done = 0;
+  }
+#if defined(IO_URING)
+  if (useuring)
+    ringread(jobs, n);
+#else
+  (void)useuring;
+#endif
+  poolread(jobs, n, nthreads);
+  lua_createtable(L, (int)n, 0);  /* 3: contents */
+  lua_newtable(L);  /* 4: errors */
+  for (i = 0; i < n; i++) {
+    ReadJob *j = &jobs[i];
+    if (j->err == 0)
+      lua_pushlstring(L, j->data, j->len);
+    else {
+      lua_pushfstring(L, "%s: %s", j->path, strerror(j->err));
+      lua_rawseti(L, 4, (int)i + 1);
+      lua_pushboolean(L, 0);
+    }
+    free(j->data);
+    j->data = NULL;
+    lua_rawseti(L, 3, (int)i + 1);
+  }
+  return 2;
+}
+
+#endif
+
+
+/* --- whole files --- */
+
+/*
+** io.readfile(path): returns the contents of the file, read with one
+** allocation sized by fstat (and, for a regular file, a single read).
+*/
+static int io_readfile (lua_State *L) {
+  const char *path = luaL_checkstring(L, 1);
+#if defined(LUA_USE_POSIX)
+  ReadJob j;
+  memset(&j, 0, sizeof(j));
+  j.path = path;
+  readjob(&j);
+  if (j.err != 0) {
+    free(j.data);
+    errno = j.err;
+    return luaL_fileresult(L, 0, path);
+  }
+  lua_pushlstring(L, j.data, j.len);
+  free(j.data);
+#else
+  FILE *f = fopen(path, "rb");
+  luaL_Buffer b;
+  size_t n;
+  if (f == NULL)
+    return luaL_fileresult(L, 0, path);
+  luaL_buffinit(L, &b);
+  do {
+    n = fread(luaL_prepbuffer(&b), 1, LUAL_BUFFERSIZE, f);
+    luaL_addsize(&b, n);
+  } while (n == LUAL_BUFFERSIZE);
+  if (ferror(f)) {
+    int en = errno;
+    fclose(f);
+    errno = en;
+    return luaL_fileresult(L, 0, path);
+  }
+  fclose(f);
+  luaL_pushresult(&b);
+#endif
+  return 1;
+}
+
+
+#if defined(LUA_USE_POSIX)
+
+/* room for the suffix opentemp adds to a path */
+#define TEMPSUFFIX	48
+
+/*
+** Create a new file beside path, named in tmp, to replace it. A new file
+** gets 0666 less the umask, applied by open, since asking umask for the
+** mask means changing it for every thread; a replacement then takes the
+** permissions of the old file, if any.
+*/
+static int opentemp (const char *path, char *tmp) {
+  struct stat st;
+  int fd, tries = 0;
+  do {  /* O_EXCL makes a name in use fail, never reopen it */
+    sprintf(tmp, "%s.%ld.%lx.%d", path, (long)getpid(),
+            (unsigned long)(size_t)tmp, tries);
+    fd = open(tmp, O_WRONLY | O_CREAT | O_EXCL, 0666);
+  } while (fd < 0 && errno == EEXIST && ++tries < 100);
+  if (fd >= 0 && stat(path, &st) == 0 &&
+      fchmod(fd, st.st_mode & 07777) != 0) {
+    int en = errno;
+    close(fd);
+    unlink(tmp);
+    errno = en;
+    fd = -1;
+  }
+  return fd;
+}
+
+
+/* makes a rename inside dir (the start of path, up to len) durable */
+static void syncdir (char *path, size_t len) {
+  int fd;
+  while (len > 0 && path[len - 1] != '/')
+    len--;
+  if (len == 0)
+    fd = open(".", O_RDONLY);
+  else {
+    char c = path[len];
+    path[len] = '\0';
+    fd = open(path, O_RDONLY);
+    path[len] = c;
+  }
+  if (fd >= 0) {
+    fsync(fd);
+    close(fd);
+  }
+}
+
+#endif
+
+
+/*
+** io.writefile(path, data, [opts]): writes data (a string, or a table of
+** fragments as for file:writeall) as the whole of the file. On POSIX
+** systems it goes to a temporary file in the same directory, which is
+** then renamed over path, unless opts.atomic is false; opts.fsync makes
+** the data (and the rename) durable before returning.
+*/
+static int io_writefile (lua_State *L) {
+  const char *path = luaL_checkstring(L, 1);
+  int atomic = 1, sync = 0, ok, en;
+  int i, n = 0;
+  FILE *f;
+#if defined(LUA_USE_POSIX)
+  char *tmp = NULL;
+  size_t plen = strlen(path);
+#endif
+  if (lua_type(L, 2) == LUA_TTABLE) {
+    n = (int)lua_objlen(L, 2);
+    for (i = 1; i <= n; i++) {  /* check now, not halfway through */
+      lua_rawgeti(L, 2, i);
+      if (!lua_isstring(L, -1))
+        return luaL_error(L, "invalid value (at index %d) in table for "
+                             LUA_QL("writefile"), i);
+      lua_pop(L, 1);
+    }
+  }
+  else
+    luaL_checkstring(L, 2);
+  if (!lua_isnoneornil(L, 3)) {
+    luaL_checktype(L, 3, LUA_TTABLE);
+    lua_getfield(L, 3, "atomic");
+    atomic = lua_isnil(L, -1) || lua_toboolean(L, -1);
+    lua_getfield(L, 3, "fsync");
+    sync = lua_toboolean(L, -1);
+    lua_pop(L, 2);
+  }
+#if defined(LUA_USE_POSIX)
+  if (atomic) {
+    int fd;
+    tmp = (char *)lua_newuserdata(L, plen + TEMPSUFFIX);
+    if ((fd = opentemp(path, tmp)) < 0)
+      return luaL_fileresult(L, 0, path);
+    if ((f = fdopen(fd, "wb")) == NULL) {
+      en = errno;
+      close(fd);
+      unlink(tmp);
+      errno = en;
+      return luaL_fileresult(L, 0, path);
+    }
+  }
+  else if ((f = fopen(path, "wb")) == NULL)
+    return luaL_fileresult(L, 0, path);
+#else
+  (void)atomic;
+  if ((f = fopen(path, "wb")) == NULL)
+    return luaL_fileresult(L, 0, path);
+#endif
+  if (lua_type(L, 2) == LUA_TTABLE) {
+    size_t done = 0;  /* writefile reports only success or failure */
+    ok = writefrags(L, f, 2, 1, n, &done);
+  }
+  else {
+    size_t l;
+    const char *s = lua_tolstring(L, 2, &l);
+    ok = (fwrite(s, 1, l, f) == l);
+  }
+  ok = ok && fflush(f) == 0;
+#if defined(LUA_USE_POSIX)
+  if (ok && sync)
+    ok = (fsync(fileno(f)) == 0);
+#else
+  (void)sync;
+#endif
+  en = errno;
+  if (fclose(f) != 0 && ok) {
+    ok = 0;
+    en = errno;
+  }
+#if defined(LUA_USE_POSIX)
+  if (tmp != NULL) {
+    if (ok && rename(tmp, path) != 0) {
+      ok = 0;
+      en = errno;
+    }
+    if (!ok)
+      unlink(tmp);
+    else if (sync)
+      syncdir(tmp, plen);
+  }
+#endif
+  if (!ok) {
+    errno = en;
+    return luaL_fileresult(L, 0, path);
+  }
+  lua_pushboolean(L, 1);
+  return 1;
+}
+
+
+#if defined(LUA_USE_POSIX)
+#include <poll.h>
+#if defined(__linux__)
+#include <sys/inotify.h>
+#define IO_INOTIFY
+#endif
+
+/* --- following a growing file --- */
+
+#define FOLLOW	"fiveq.io.follow"
+
+/* longest wait between checks for rotation, even with inotify */
+#define FOLLOWSLICE	1.0
+
+/* default polling period without inotify */
+#define FOLLOWINTERVAL	0.25
+
+typedef struct Follow {
+  dev_t dev;  /* identity of the file being read */
+  ino_t ino;
+  int ifd;  /* inotify descriptor, or -1 */
+  int wd;  /* its watch on the file */
+  int draining;  /* path names another file: read the old one once more */
+  double timeout;  /* < 0 for none */
+  double interval;  /* polling period without inotify */
+} Follow;
+
+
+static void followwatch (Follow *fw, const char *path) {
+#if defined(IO_INOTIFY)
+  if (fw->ifd >= 0) {
+    if (fw->wd >= 0)
+      inotify_rm_watch(fw->ifd, fw->wd);
+    fw->wd = inotify_add_watch(fw->ifd, path, IN_MODIFY | IN_ATTRIB |
+                               IN_MOVE_SELF | IN_DELETE_SELF);
+  }
+#else
+  (void)fw; (void)path;
+#endif
+}
+
+
+/* opens path for following; sets errno and returns NULL on failure */
+static FILE *followopen (Follow *fw, const char *path) {
+  struct stat st;
+  FILE *f = fopen(path, "r");
+  if (f == NULL)
+    return NULL;
+  if (fstat(fileno(f), &st) != 0) {
+    int en = errno;
+    fclose(f);
+    errno = en;
+    return NULL;
+  }
+  setvbuf(f, NULL, _IOFBF, IO_READBUFSIZE);
+  fw->dev = st.st_dev;
+  fw->ino = st.st_ino;
+  fw->draining = 0;
+  followwatch(fw, path);
+  return f;
+}
+
+
+/*
+** Called at end of file: returns 1 if there may be more to read (the file
+** was truncated, or path names another file and the old one gets one more
+** read), 2 if *pf is now that other file, else 0.
+*/
+static int followcheck (lua_State *L, FILE **pf, Follow *fw,
+                        const char *path) {
+  struct stat st;
+  FILE *nf;
+  if (fstat(fileno(*pf), &st) == 0 && st.st_size < ftello(*pf)) {
+    fseeko(*pf, 0, SEEK_SET);  /* truncated: start over */
+    lua_pushliteral(L, "");
+    lua_replace(L, lua_upvalueindex(3));  /* drop any partial line */
+    return 1;
+  }
+  if (stat(path, &st) != 0 || (st.st_dev == fw->dev && st.st_ino == fw->ino))
+    return 0;
+  if (!fw->draining) {  /* rotated: the writer may not have noticed yet */
+    fw->draining = 1;
+    return 1;
+  }
+  if ((nf = followopen(fw, path)) == NULL)
+    return 0;  /* try again later */
+  fclose(*pf);
+  *pf = nf;
+  return 2;
+}
+
+
+/* waits for a change to the file, or for the deadline (0 for none) */
+static void followwait (Follow *fw, double deadline) {
+  double slice = (fw->ifd >= 0) ? FOLLOWSLICE : fw->interval;
+  if (deadline > 0) {
+    double left = deadline - monotime();
+    if (left < slice) slice = left;
+  }
+  if (slice <= 0)
+    return;
+#if defined(IO_INOTIFY)
+  if (fw->ifd >= 0) {
+    struct pollfd pfd;
+    pfd.fd = fw->ifd;
+    pfd.events = POLLIN;
+    if (poll(&pfd, 1, (int)(slice * 1e3) + 1) > 0) {
+      char events[4096];  /* only their arrival matters */
+      while (read(fw->ifd, events, sizeof(events)) > 0)
+        ;
+    }
+    return;
+  }
+#endif
+  {
+    struct timespec ts;
+    ts.tv_sec = (time_t)slice;
+    ts.tv_nsec = (long)((slice - (double)ts.tv_sec) * 1e9);
+    nanosleep(&ts, NULL);
+  }
+}
+
+
+/* upvalue[1]=file; upvalue[2]=Follow; upvalue[3]=partial line; upvalue[4]=path */
+static int io_followline (lua_State *L) {
+  FILE **pf = (FILE **)lua_touserdata(L, lua_upvalueindex(1));
+  Follow *fw = (Follow *)lua_touserdata(L, lua_upvalueindex(2));
+  const char *path = lua_tostring(L, lua_upvalueindex(4));
+  double deadline = (fw->timeout < 0) ? 0 : monotime() + fw->timeout;
+  lua_settop(L, 0);
+  if (*pf == NULL)
+    return luaL_error(L, "file is already closed");
+  for (;;) {
+    int ok, changed;
+    clearerr(*pf);
+    ok = read_line(L, *pf, 1);
+    if (ferror(*pf))
+      return luaL_error(L, "%s: %s", path, strerror(errno));
+    if (ok && lua_objlen(L, lua_upvalueindex(3)) > 0) {
+      lua_pushvalue(L, lua_upvalueindex(3));  /* join to the partial line */
+      lua_insert(L, -2);
+      lua_concat(L, 2);
+      lua_pushliteral(L, "");
+      lua_replace(L, lua_upvalueindex(3));
+    }
+    if (ok && !feof(*pf))  /* a whole line */
+      return 1;
+    if (lua_objlen(L, -1) > 0) {  /* end of file in mid-line: keep it */
+      lua_replace(L, lua_upvalueindex(3));
+      fw->draining = 0;  /* that was new data */
+    }
+    else
+      lua_pop(L, 1);
+    if ((changed = followcheck(L, pf, fw, path)) != 0) {
+      if (changed == 2 && lua_objlen(L, lua_upvalueindex(3)) > 0) {
+        lua_pushvalue(L, lua_upvalueindex(3));  /* the old file's last */
+        lua_pushliteral(L, "");                 /* line ends here */
+        lua_replace(L, lua_upvalueindex(3));
+        return 1;
+      }
+      continue;
+    }
+    if (deadline > 0 && monotime() >= deadline)
+      return 0;
+    followwait(fw, deadline);
+  }
+}
+
+
+static int follow_gc (lua_State *L) {
+  Follow *fw = (Follow *)luaL_checkudata(L, 1, FOLLOW);
+  if (fw->ifd >= 0) {
+    close(fw->ifd);
+    fw->ifd = -1;
+  }
+  return 0;
+}
+
+
+/*
+** io.follow(path, [opts]): an iterator over the lines of path as they are
+** written, like tail -F. opts.start is "end" (default) or "begin";
+** opts.timeout is how long, in seconds, the iterator waits for a line
+** before returning nil; opts.interval is the polling period where
+** inotify isn't available.
+*/
+static int io_follow (lua_State *L) {
+  const char *path = luaL_checkstring(L, 1);
+  const char *start = "end";
+  double timeout = -1, interval = FOLLOWINTERVAL;
+  FILE **pf;
+  Follow *fw;
+  if (!lua_isnoneornil(L, 2)) {
+    luaL_checktype(L, 2, LUA_TTABLE);
+    lua_getfield(L, 2, "start");
+    start = luaL_optstring(L, -1, start);
+    lua_getfield(L, 2, "timeout");
+    timeout = luaL_optnumber(L, -1, timeout);
+    lua_getfield(L, 2, "interval");
+    interval = luaL_optnumber(L, -1, interval);
+    lua_pop(L, 3);
+    luaL_argcheck(L, strcmp(start, "end") == 0 || strcmp(start, "begin") == 0,
+                  2, "start should be " LUA_QL("end") " or " LUA_QL("begin"));
+    luaL_argcheck(L, interval > 0, 2, "positive interval expected");
+  }
+  lua_settop(L, 1);
+  pf = newfile(L);  /* 2 */
+  fw = (Follow *)lua_newuserdata(L, sizeof(Follow));  /* 3 */
+  fw->ifd = fw->wd = -1;
+  fw->timeout = timeout;
+  fw->interval = interval;
+  luaL_getmetatable(L, FOLLOW);
+  lua_setmetatable(L, -2);
+#if defined(IO_INOTIFY)
+  fw->ifd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+  if (fw->ifd >= 0) {  /* watch the directory for a replacement file */
+    const char *slash = strrchr(path, '/');
+    if (slash == NULL)
+      lua_pushliteral(L, ".");
+    else
+      lua_pushlstring(L, path, (slash == path) ? 1 : (size_t)(slash - path));
+    inotify_add_watch(fw->ifd, lua_tostring(L, -1), IN_CREATE | IN_MOVED_TO);
+    lua_pop(L, 1);
+  }
+#endif
+  if ((*pf = followopen(fw, path)) == NULL)
+    return luaL_fileresult(L, 0, path);
+  if (start[0] == 'e' && fseeko(*pf, 0, SEEK_END) != 0)
+    return luaL_fileresult(L, 0, path);
+  lua_pushliteral(L, "");  /* 4: partial line */
+  lua_pushvalue(L, 1);
+  lua_pushcclosure(L, io_followline, 4);
+  return 1;
+}
+
+#endif
+
+
+/*
+** The writer's ring is only ever advanced by one side each: the Lua thread
+** moves tail after copying a message in, the drainer moves head after
+** writing data out, so neither takes a lock. The mutex and condition
+** variables are only for sleeping: the drainer waits flush_ms for data
+** (or to be woken when the ring is half full), the Lua thread waits for
+** space under the "block" policy and in flush.
+*/
+#if defined(LUA_USE_POSIX) && defined(__GNUC__)
+#define IO_ASYNCWRITER
+
+/* --- asynchronous writer --- */
+
+#define ASYNCWRITER	"fiveq.io.asyncwriter"
+
+#define AWBUFSIZE	(1 << 20)
+#define AWFLUSHMS	50
+
+enum { AW_BLOCK, AW_DROP, AW_COUNT };
+
+typedef struct AsyncWriter {
+  char *buf;  /* the ring: NULL once closed */
+  size_t size, mask;
+  size_t head, tail;  /* bytes drained and bytes queued, ever */
+  int fd;
+  int policy;
+  int sync;  /* fsync after each batch */
+  int flushms;
+  int sleeping;  /* the drainer is waiting for data */
+  int waiting;  /* the Lua thread is waiting for space */
+  int wake;  /* flush or close asked for: drain now */
+  int stop;
+  int err;  /* errno of the first failed write, or 0 */
+  size_t written, writes, dropped, droppedbytes, blocked;
+  pthread_t thread;
+  pthread_mutex_t lock;
+  pthread_cond_t more, space;
+} AsyncWriter;
+
+#define awload(p)	__atomic_load_n(p, __ATOMIC_SEQ_CST)
+#define awstore(p,v)	__atomic_store_n(p, v, __ATOMIC_SEQ_CST)
+#define awadd(p,v)	__atomic_add_fetch(p, v, __ATOMIC_RELAXED)
+
+
+/* writes the ring's contents from head to tail */
+static void awdrain (AsyncWriter *w, size_t head, size_t tail) {
+  while (head != tail) {
+    struct iovec iov[2];
+    size_t off = head & w->mask, n = tail - head;
+    int cnt = 1;
+    ssize_t r;
+    iov[0].iov_base = w->buf + off;
+    iov[0].iov_len = (n < w->size - off) ? n : w->size - off;
+    if (iov[0].iov_len < n) {  /* wraps around */
+      iov[1].iov_base = w->buf;
+      iov[1].iov_len = n - iov[0].iov_len;
+      cnt = 2;
+    }
+    if (awload(&w->err) != 0)
+      r = (ssize_t)n;  /* discard: the file is broken */
+    else if ((r = writev(w->fd, iov, cnt)) < 0) {
+      if (errno == EINTR) continue;
+      awstore(&w->err, errno);
+      r = (ssize_t)n;
+    }
+    else {
+      awadd(&w->written, (size_t)r);
+      awadd(&w->writes, 1);
+    }
+    head += (size_t)r;
+    awstore(&w->head, head);
+    if (awload(&w->waiting)) {
+      pthread_mutex_lock(&w->lock);
+      pthread_cond_broadcast(&w->space);
+      pthread_mutex_unlock(&w->lock);
+    }
+  }
+}
+
+
+static void *awthread (void *arg) {
+  AsyncWriter *w = (AsyncWriter *)arg;
+  for (;;) {
+    size_t head = w->head, tail = awload(&w->tail);
+    if (head != tail) {
+      awdrain(w, head, tail);
+      if (w->sync && awload(&w->err) == 0 && fsync(w->fd) != 0 &&
+          errno != EINVAL)  /* EINVAL: a pipe or such */
+        awstore(&w->err, errno);
+      continue;
+    }
+    if (awload(&w->stop))
+      break;
+    pthread_mutex_lock(&w->lock);
+    awstore(&w->sleeping, 1);
+    if (awload(&w->tail) == head && !awload(&w->wake)) {
+      struct timespec ts;
+      clock_gettime(CLOCK_REALTIME, &ts);
+      ts.tv_sec += w->flushms / 1000;
+      ts.tv_nsec += (long)(w->flushms % 1000) * 1000000L;
+      if (ts.tv_nsec >= 1000000000L) {
+        ts.tv_sec++;
+        ts.tv_nsec -= 1000000000L;
+      }
+      pthread_cond_timedwait(&w->more, &w->lock, &ts);
+    }
+    awstore(&w->sleeping, 0);
+    awstore(&w->wake, 0);
+    if (awload(&w->waiting))  /* flush waits on an empty ring too */
+      pthread_cond_broadcast(&w->space);
+    pthread_mutex_unlock(&w->lock);
+  }
+  return NULL;
+}
+
+
+static void awwake (AsyncWriter *w) {
+  pthread_mutex_lock(&w->lock);
+  awstore(&w->wake, 1);
+  pthread_cond_signal(&w->more);
+  pthread_mutex_unlock(&w->lock);
+}
+
+
+/* waits until the ring has room for need bytes (or has been drained) */
+static void awwait (AsyncWriter *w, size_t need) {
+  pthread_mutex_lock(&w->lock);
+  awstore(&w->waiting, 1);
+  while (w->size - (w->tail - awload(&w->head)) < need) {
+    awstore(&w->wake, 1);
+    pthread_cond_signal(&w->more);
+    pthread_cond_wait(&w->space, &w->lock);
+  }
+  awstore(&w->waiting, 0);
+  pthread_mutex_unlock(&w->lock);
+}
+
+
+/* copies s into the ring, which has room for it, without publishing it */
+static void awput (AsyncWriter *w, size_t *tail, const char *s, size_t l) {
+  size_t off = *tail & w->mask;
+  size_t first = (l < w->size - off) ? l : w->size - off;
+  memcpy(w->buf + off, s, first);
+  memcpy(w->buf, s + first, l - first);
+  *tail += l;
+}
+
+
+static void awpublish (AsyncWriter *w, size_t tail) {
+  awstore(&w->tail, tail);
+  if (tail - awload(&w->head) >= w->size / 2 && awload(&w->sleeping))
+    awwake(w);
+}
+
+
+static AsyncWriter *checkwriter (lua_State *L) {
+  AsyncWriter *w = (AsyncWriter *)luaL_checkudata(L, 1, ASYNCWRITER);
+  if (w->buf == NULL)
+    luaL_error(L, "attempt to use a closed writer");
+  return w;
+}
+
+
+static int awresult (lua_State *L, AsyncWriter *w) {
+  errno = awload(&w->err);
+  return luaL_fileresult(L, 0, NULL);
+}
+
+
+/*
+** writer:write(...): queues the strings and numbers for the drainer and
+** returns writer. When they don't fit, "block" waits for room, while
+** "drop" and "count" discard them (write then returns false under "drop").
+*/
+static int aw_write (lua_State *L) {
+  AsyncWriter *w = checkwriter(L);
+  int nargs = lua_gettop(L), i;
+  size_t total = 0, tail = w->tail;
+  for (i = 2; i <= nargs; i++) {
+    size_t l;
+    luaL_checklstring(L, i, &l);
+    total += l;
+  }
+  if (awload(&w->err) != 0)
+    return awresult(L, w);
+  if (w->size - (tail - awload(&w->head)) < total) {
+    if (w->policy != AW_BLOCK) {
+      w->dropped++;
+      w->droppedbytes += total;
+      if (w->policy == AW_DROP) {
+        lua_pushboolean(L, 0);
+        return 1;
+      }
+      lua_settop(L, 1);
+      return 1;
+    }
+    w->blocked++;
+  }
+  for (i = 2; i <= nargs; i++) {
+    size_t l;
+    const char *s = lua_tolstring(L, i, &l);
+    while (l > 0) {  /* a message larger than the ring goes in pieces */
+      size_t room = w->size - (tail - awload(&w->head)), k;
+      if (room == 0) {
+        awpublish(w, tail);
+        awwait(w, (l < w->size) ? l : w->size);
+        continue;
+      }
+      k = (l < room) ? l : room;
+      awput(w, &tail, s, k);
+      s += k;
+      l -= k;
+    }
+  }
+  awpublish(w, tail);
+  lua_settop(L, 1);
+  return 1;
+}
+
+
+/* writer:flush(): returns once everything queued has been written */
+static int aw_flush (lua_State *L) {
+  AsyncWriter *w = checkwriter(L);
+  awwake(w);
+  awwait(w, w->size);
+  if (awload(&w->err) != 0)
+    return awresult(L, w);
+  lua_settop(L, 1);
+  return 1;
 }
 
 
-static int f_read (lua_State *L) {
-  return g_read(L, tofile(L), 2);
+static int awclose (AsyncWriter *w) {
+  int err;
+  if (w->buf == NULL)
+    return 0;
+  awstore(&w->stop, 1);
+  awwake(w);
+  pthread_join(w->thread, NULL);
+  err = w->err;
+  if (close(w->fd) != 0 && err == 0)
+    err = errno;
+  free(w->buf);
+  w->buf = NULL;
+  pthread_cond_destroy(&w->space);
+  pthread_cond_destroy(&w->more);
+  pthread_mutex_destroy(&w->lock);
+  return err;
 }
 
 
+/* writer:close(): writes what is queued, stops the drainer and closes */
+static int aw_close (lua_State *L) {
+  AsyncWriter *w = checkwriter(L);
+  int err = awclose(w);
+  if (err != 0) {
+    errno = err;
+    return luaL_fileresult(L, 0, NULL);
+  }
+  lua_pushboolean(L, 1);
+  return 1;
+}
 
-/* upvalue[1]=file; upvalue[2]=created file?; upvalue[3]=number of saved args; upvalues[4+]=args... */
-static int io_readline (lua_State *L) {
-   FILE *f = *(FILE **)lua_touserdata(L, lua_upvalueindex(1));
-   if (f == NULL)  /* file is already closed? */
-     luaL_error(L, "file is already closed");
-   lua_settop(L, 1);
-   int n = (int)lua_tointeger(L, lua_upvalueindex(3));
-   int i;
-   for (i = 1; i <= n; i++)  /* push arguments to 'g_read' */
-     lua_pushvalue(L, lua_upvalueindex(3 + i));
-   n = g_read(L, f, 2);  /* 'n' is number of results */
-   lua_assert(n > 0);  /* should return at least a nil */
-   if (!lua_isnil(L, -n))  /* read at least one value? */
-     return n;  /* return them */
-   else {  /* first result is nil: EOF or error */
-     if (!lua_isnil(L, -1))  /* is there error information? */
-       return luaL_error(L, "%s", lua_tostring(L, -1));  /* error */
-     /* else EOF */
-     if (lua_toboolean(L, lua_upvalueindex(2))) {  /* generator created file? */
-      lua_settop(L, 0);
-      lua_pushvalue(L, lua_upvalueindex(1));
-      /* close it */
-      lua_getfenv(L, 1);
-      lua_getfield(L, -1, "__close");
-      return (lua_tocfunction(L, -1))(L);
-    }
-    return 0;
+
+static void setcount (lua_State *L, const char *name, size_t v) {
+  lua_pushnumber(L, (lua_Number)v);
+  lua_setfield(L, -2, name);
+}
+
+
+/* writer:stats(): a table of counters */
+static int aw_stats (lua_State *L) {
+  AsyncWriter *w = (AsyncWriter *)luaL_checkudata(L, 1, ASYNCWRITER);
+  lua_createtable(L, 0, 8);
+  setcount(L, "bufsize", w->size);
+  setcount(L, "pending", w->buf ? w->tail - awload(&w->head) : 0);
+  setcount(L, "written", awload(&w->written));
+  setcount(L, "writes", awload(&w->writes));
+  setcount(L, "dropped", w->dropped);
+  setcount(L, "droppedbytes", w->droppedbytes);
+  setcount(L, "blocked", w->blocked);
+  if (awload(&w->err) != 0) {
+    lua_pushstring(L, strerror(awload(&w->err)));
+    lua_setfield(L, -2, "error");
   }
+  return 1;
 }
 
 
-static int f_write (lua_State *L) {
-  FILE *f = tofile(L);
-  int arg = 2;
-  int nargs = lua_gettop(L) - 1;
-  int status = 1;
-  for (; nargs--; arg++) {
-    if (lua_type(L, arg) == LUA_TNUMBER) {
-      /* optimization: could be done exactly as for strings */
-      status = status &&
-          fprintf(f, LUA_NUMBER_FMT, lua_tonumber(L, arg)) > 0;
-    }
-    else {
-      size_t l;
-      const char *s = luaL_checklstring(L, arg, &l);
-      status = status && (fwrite(s, sizeof(char), l, f) == l);
+static int aw_gc (lua_State *L) {
+  awclose((AsyncWriter *)luaL_checkudata(L, 1, ASYNCWRITER));
+  return 0;
+}
+
+
+static int aw_tostring (lua_State *L) {
+  AsyncWriter *w = (AsyncWriter *)luaL_checkudata(L, 1, ASYNCWRITER);
+  if (w->buf == NULL)
+    lua_pushliteral(L, "asyncwriter (closed)");
+  else
+    lua_pushfstring(L, "asyncwriter (%p)", (void *)w);
+  return 1;
+}
+
+
+/*
+** io.asyncwriter(target, [opts]): target is a path (opened for appending)
+** or a file handle (flushed, then written through a duplicate of its
+** descriptor). opts: bufsize (bytes in the ring, default 1 MB), flush_ms
+** (longest data waits in the ring, default 50), policy ("block", "drop"
+** or "count") and fsync (after each batch written).
+*/
+static int io_asyncwriter (lua_State *L) {
+  static const char *const policies[] = {"block", "drop", "count", NULL};
+  lua_Number bufsize = AWBUFSIZE, flushms = AWFLUSHMS;
+  int policy = AW_BLOCK, sync = 0, en;
+  size_t size = 4096;
+  AsyncWriter *w;
+  if (!lua_isnoneornil(L, 2)) {
+    luaL_checktype(L, 2, LUA_TTABLE);
+    lua_getfield(L, 2, "bufsize");
+    bufsize = luaL_optnumber(L, -1, bufsize);
+    lua_getfield(L, 2, "flush_ms");
+    flushms = luaL_optnumber(L, -1, flushms);
+    lua_getfield(L, 2, "policy");
+    if (!lua_isnil(L, -1)) {
+      const char *name = luaL_optstring(L, -1, "");
+      for (policy = 0; policies[policy] != NULL; policy++)
+        if (strcmp(policies[policy], name) == 0) break;
+      if (policies[policy] == NULL)
+        return luaL_argerror(L, 2,
+                 lua_pushfstring(L, "invalid policy " LUA_QS, name));
     }
+    lua_getfield(L, 2, "fsync");
+    sync = lua_toboolean(L, -1);
+    lua_pop(L, 4);
+    luaL_argcheck(L, bufsize > 0 && bufsize <= (lua_Number)((size_t)-1 / 2),
+                  2, "invalid bufsize");
+    luaL_argcheck(L, flushms >= 1, 2, "flush_ms should be at least 1");
   }
-  if (status) {
-    lua_pushvalue(L, 1);
+  while ((lua_Number)size < bufsize)  /* a power of 2, for masking */
+    size *= 2;
+  w = (AsyncWriter *)lua_newuserdata(L, sizeof(AsyncWriter));
+  memset(w, 0, sizeof(AsyncWriter));  /* no metatable until it's running */
+  if (lua_type(L, 1) == LUA_TSTRING) {
+    const char *path = lua_tostring(L, 1);
+    w->fd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0666);
+    if (w->fd < 0)
+      return luaL_fileresult(L, 0, path);
+  }
+  else {
+    FILE *f = tofile(L);
+    if (fflush(f) != 0 || (w->fd = fcntl(fileno(f), F_DUPFD_CLOEXEC, 0)) < 0)
+      return luaL_fileresult(L, 0, NULL);
+  }
+  w->size = size;
+  w->mask = size - 1;
+  w->policy = policy;
+  w->sync = sync;
+  w->flushms = (int)flushms;
+  if ((w->buf = (char *)malloc(size)) == NULL) {
+    close(w->fd);
+    return luaL_error(L, "not enough memory");
+  }
+  pthread_mutex_init(&w->lock, NULL);
+  pthread_cond_init(&w->more, NULL);
+  pthread_cond_init(&w->space, NULL);
+  if ((en = pthread_create(&w->thread, NULL, awthread, w)) != 0) {
+    pthread_cond_destroy(&w->space);
+    pthread_cond_destroy(&w->more);
+    pthread_mutex_destroy(&w->lock);
+    free(w->buf);
+    w->buf = NULL;
+    close(w->fd);
+    errno = en;
+    return luaL_fileresult(L, 0, NULL);
+  }
+  luaL_getmetatable(L, ASYNCWRITER);
+  lua_setmetatable(L, -2);
+  return 1;
+}
+
+
+static const luaL_Reg asyncwriter_m[] = {
+  {"close", aw_close},
+  {"flush", aw_flush},
+  {"stats", aw_stats},
+  {"write", aw_write},
+  {NULL, NULL}
+};
+
+#endif
+
+
+
+/* --- byte buffers --- */
+
+/*
+** Methods shared by memory mappings and io.buffer objects, which both
+** start with a luaQ_Buffer (see buffer.h) and index it like a string.
+*/
+
+/* string.sub-style index into bytes of length len */
+static size_t posrelat (lua_Integer pos, size_t len) {
+  if (pos >= 0) return (size_t)pos;
+  else if (0u - (size_t)pos > len) return 0;
+  else return len - (0u - (size_t)pos) + 1;
+}
+
+
+/* b:sub(i, [j]): like string.sub */
+static int bytes_sub (lua_State *L, luaQ_Buffer *b) {
+  size_t l = b->len;
+  size_t start = posrelat(luaL_checkinteger(L, 2), l);
+  size_t end = posrelat(luaL_optinteger(L, 3, -1), l);
+  if (start < 1) start = 1;
+  if (end > l) end = l;
+  if (start <= end)
+    lua_pushlstring(L, b->data + start - 1, end - start + 1);
+  else lua_pushliteral(L, "");
+  return 1;
+}
+
+
+/* b:byte([i], [j]): like string.byte */
+static int bytes_byte (lua_State *L, luaQ_Buffer *b) {
+  size_t l = b->len;
+  size_t posi = posrelat(luaL_optinteger(L, 2, 1), l);
+  size_t pose = posrelat(luaL_optinteger(L, 3, (lua_Integer)posi), l);
+  int n, i;
+  if (posi < 1) posi = 1;
+  if (pose > l) pose = l;
+  if (posi > pose) return 0;  /* empty interval; return no values */
+  if (pose - posi >= INT_MAX)  /* overflow? */
+    return luaL_error(L, "slice too long");
+  n = (int)(pose - posi) + 1;
+  luaL_checkstack(L, n, "slice too long");
+  for (i = 0; i < n; i++)
+    lua_pushinteger(L, (unsigned char)b->data[posi + i - 1]);
+  return n;
+}
+
+
+static const char *findplain (const char *s, size_t l, const char *p,
+                              size_t lp) {
+#if l_glibcprereq(2, 1) || defined(__FreeBSD__) || defined(__APPLE__)
+  return (const char *)memmem(s, l, p, lp);
+#else
+  const char *last;
+  if (lp == 0) return s;
+  if (lp > l) return NULL;
+  last = s + (l - lp);
+  for (; (s = (const char *)memchr(s, *p, (size_t)(last - s) + 1)) != NULL;
+       s++)
+    if (memcmp(s, p, lp) == 0)
+      return s;
+  return NULL;
+#endif
+}
+
+
+/* b:find(plain, [init]): like string.find(s, plain, init, true) */
+static int bytes_find (lua_State *L, luaQ_Buffer *b) {
+  size_t lp;
+  const char *p = luaL_checklstring(L, 2, &lp);
+  size_t init = posrelat(luaL_optinteger(L, 3, 1), b->len);
+  const char *s;
+  if (init < 1) init = 1;
+  if (init - 1 > b->len || lp > b->len - (init - 1)) {
+    lua_pushnil(L);
     return 1;
   }
-  else return luaL_fileresult(L, status, NULL);
+  s = findplain(b->data + init - 1, b->len - (init - 1), p, lp);
+  if (s == NULL) {
+    lua_pushnil(L);
+    return 1;
+  }
+  lua_pushinteger(L, (lua_Integer)(s - b->data) + 1);
+  lua_pushinteger(L, (lua_Integer)(s - b->data) + (lua_Integer)lp);
+  return 2;
+}
+
+
+#define IOBUFFER	"fiveq.io.buffer"
+
+/* a fixed-size block of memory that file:readinto fills; b.len bytes of it
+   hold data */
+typedef struct IOBuffer {
+  luaQ_Buffer b;  /* must come first */
+  size_t size;
+} IOBuffer;
+
+
+static IOBuffer *checkiobuffer (lua_State *L, int arg) {
+  return (IOBuffer *)luaL_checkudata(L, arg, IOBUFFER);
+}
+
+
+/* io.buffer(size): a new buffer of size bytes, holding no data yet */
+static int io_buffer (lua_State *L) {
+  lua_Integer size = luaL_checkinteger(L, 1);
+  IOBuffer *buf;
+  luaL_argcheck(L, size >= 0, 1, "non-negative size expected");
+  buf = (IOBuffer *)lua_newuserdata(L, sizeof(IOBuffer) + (size_t)size);
+  buf->b.data = (char *)(buf + 1);
+  buf->b.len = 0;
+  buf->size = (size_t)size;
+  luaL_getmetatable(L, IOBUFFER);
+  lua_setmetatable(L, -2);
+  return 1;
+}
+
+
+static int buf_len (lua_State *L) {
+  lua_pushinteger(L, (lua_Integer)checkiobuffer(L, 1)->b.len);
+  return 1;
+}
+
+
+static int buf_size (lua_State *L) {
+  lua_pushinteger(L, (lua_Integer)checkiobuffer(L, 1)->size);
+  return 1;
+}
+
+
+static int buf_sub (lua_State *L) {
+  return bytes_sub(L, &checkiobuffer(L, 1)->b);
+}
+
+
+static int buf_byte (lua_State *L) {
+  return bytes_byte(L, &checkiobuffer(L, 1)->b);
+}
+
+
+static int buf_find (lua_State *L) {
+  return bytes_find(L, &checkiobuffer(L, 1)->b);
+}
+
+
+static int buf_tostring (lua_State *L) {
+  IOBuffer *buf = checkiobuffer(L, 1);
+  lua_pushfstring(L, "buffer (%f of %f bytes)", (lua_Number)buf->b.len,
+                  (lua_Number)buf->size);
+  return 1;
+}
+
+
+/*
+** file:readinto(buf, n, [offset]): reads up to n bytes into buf at byte
+** offset (default 0), without making a string; buf then holds offset plus
+** the bytes read. Returns that count, or nil at end of file.
+*/
+static int f_readinto (lua_State *L) {
+  FILE *f = tofile(L);
+  IOBuffer *buf = checkiobuffer(L, 2);
+  lua_Integer n = luaL_checkinteger(L, 3);
+  lua_Integer offset = luaL_optinteger(L, 4, 0);
+  size_t got;
+#if defined(IO_STATS)
+  double t0 = monotime();
+  IOStats *hs = handlestats(L, 1);
+#endif
+  luaL_argcheck(L, n >= 0, 3, "non-negative count expected");
+  luaL_argcheck(L, offset >= 0 && (size_t)offset <= buf->size, 4,
+                "offset out of range");
+  luaL_argcheck(L, (size_t)n <= buf->size - (size_t)offset, 3,
+                "count too large for buffer");
+  clearerr(f);
+  got = fread(buf->b.data + offset, 1, (size_t)n, f);
+  buf->b.len = (size_t)offset + got;
+#if defined(IO_STATS)
+  t0 = monotime() - t0;
+  iostats.reads++;
+  iostats.bytesread += got;
+  iostats.readtime += t0;
+  if (hs != NULL) {
+    hs->reads++;
+    hs->bytesread += got;
+    hs->readtime += t0;
+  }
+#endif
+  if (ferror(f))
+    return luaL_fileresult(L, 0, NULL);
+  if (got == 0 && n > 0)
+    lua_pushnil(L);
+  else
+    lua_pushinteger(L, (lua_Integer)got);
+  return 1;
 }
 
 
+static const luaL_Reg iobuffer_m[] = {
+  {"byte", buf_byte},
+  {"find", buf_find},
+  {"len", buf_len},
+  {"size", buf_size},
+  {"sub", buf_sub},
+  {NULL, NULL}
+};
+
 
 /*
 ** functions for 'io' library
 */
+#if defined(LUA_USE_POSIX) && defined(POSIX_FADV_NORMAL)
+
+/* --- page cache advice --- */
+
+/*
+** file:advise(advice, [offset], [len]): tells the kernel how the file's
+** bytes [offset, offset + len) (len 0, the default, meaning to the end)
+** will be read; returns file
+*/
+static int f_advise (lua_State *L) {
+  static const char *const advices[] =
+    {"normal", "sequential", "random", "noreuse", "willneed", "dontneed",
+     NULL};
+  static const int advicevals[] =
+    {POSIX_FADV_NORMAL, POSIX_FADV_SEQUENTIAL, POSIX_FADV_RANDOM,
+     POSIX_FADV_NOREUSE, POSIX_FADV_WILLNEED, POSIX_FADV_DONTNEED};
+  FILE *f = tofile(L);
+  int advice = luaL_checkoption(L, 2, NULL, advices);
+  lua_Number off = luaL_optnumber(L, 3, 0);
+  lua_Number len = luaL_optnumber(L, 4, 0);
+  int fd, en;
+  luaL_argcheck(L, off >= 0, 3, "negative offset");
+  luaL_argcheck(L, len >= 0, 4, "negative length");
+  if (advicevals[advice] == POSIX_FADV_DONTNEED)
+    fflush(f);  /* so that buffered writes are covered too */
+  if ((fd = fileno(f)) < 0)  /* "z" and "d" files have no descriptor */
+    en = EBADF;
+  else
+    en = posix_fadvise(fd, (off_t)off, (off_t)len, advicevals[advice]);
+  if (en != 0) {
+    errno = en;
+    return luaL_fileresult(L, 0, NULL);
+  }
+  lua_pushvalue(L, 1);
+  return 1;
+}
+
+#endif
+
+#if defined(LUA_USE_POSIX)
+#include <sys/mman.h>
+
+/* --- memory-mapped files --- */
+
+#define MMAPHANDLE	"fiveq.io.mmap"
+
+typedef struct MMap {
+  luaQ_Buffer b;  /* must come first; b.len is 0 once closed */
+  size_t maplen;  /* length of the mapping, still reserved after close */
+  int closed;
+} MMap;
+
+
+static MMap *tommap (lua_State *L) {
+  MMap *m = (MMap *)luaL_checkudata(L, 1, MMAPHANDLE);
+  if (m->closed)
+    luaL_error(L, "attempt to use a closed mapping");
+  return m;
+}
+
+
+static int io_mmap (lua_State *L) {
+  static const char *const advices[] =
+    {"normal", "random", "sequential", "willneed", NULL};
+  static const int advicevals[] =
+    {POSIX_MADV_NORMAL, POSIX_MADV_RANDOM, POSIX_MADV_SEQUENTIAL,
+     POSIX_MADV_WILLNEED};
+  const char *filename = luaL_checkstring(L, 1);
+  int advice = luaL_checkoption(L, 2, "normal", advices);
+  struct stat st;
+  int fd;
+  MMap *m = (MMap *)lua_newuserdata(L, sizeof(MMap));
+  m->b.data = NULL;  /* create a `closed' mapping first, as newfile does */
+  m->b.len = m->maplen = 0;
+  m->closed = 1;
+  luaL_getmetatable(L, MMAPHANDLE);
+  lua_setmetatable(L, -2);
+  fd = open(filename, O_RDONLY);
+  if (fd < 0)
+    return luaL_fileresult(L, 0, filename);
+  if (fstat(fd, &st) != 0) {
+    int en = errno;
+    close(fd);
+    errno = en;
+    return luaL_fileresult(L, 0, filename);
+  }
+  if (st.st_size > 0) {  /* empty files can't be mapped */
+    void *p = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (p == MAP_FAILED) {
+      int en = errno;
+      close(fd);
+      errno = en;
+      return luaL_fileresult(L, 0, filename);
+    }
+    m->b.data = (char *)p;
+    m->b.len = m->maplen = (size_t)st.st_size;
+    posix_madvise(p, m->maplen, advicevals[advice]);
+  }
+  close(fd);
+  m->closed = 0;
+  return 1;
+}
+
+
+static int m_len (lua_State *L) {
+  lua_pushinteger(L, (lua_Integer)tommap(L)->b.len);
+  return 1;
+}
+
+
+static int m_sub (lua_State *L) {
+  return bytes_sub(L, &tommap(L)->b);
+}
+
+
+static int m_byte (lua_State *L) {
+  return bytes_byte(L, &tommap(L)->b);
+}
+
+
+/* m:find(plain, [init]): like string.find(s, plain, init, true) */
+static int m_find (lua_State *L) {
+  return bytes_find(L, &tommap(L)->b);
+}
+
+
+/*
+** Closing drops the file's pages but keeps the address range, replaced by
+** zero pages, so that cursors still pointing into it read zeros instead of
+** faulting; __gc releases the range. Without anonymous mappings the file
+** stays mapped until then.
+*/
+#if !defined(MAP_ANON) && defined(MAP_ANONYMOUS)
+#define MAP_ANON	MAP_ANONYMOUS
+#endif
+
+static int m_close (lua_State *L) {
+  MMap *m = tommap(L);
+#if defined(MAP_ANON)
+  if (m->maplen > 0 &&
+      mmap(m->b.data, m->maplen, PROT_READ,
+           MAP_PRIVATE | MAP_ANON | MAP_FIXED, -1, 0) == MAP_FAILED)
+    return luaL_fileresult(L, 0, NULL);
+#endif
+  m->b.len = 0;
+  m->closed = 1;
+  lua_pushboolean(L, 1);
+  return 1;
+}
+
+
+static int m_gc (lua_State *L) {
+  MMap *m = (MMap *)luaL_checkudata(L, 1, MMAPHANDLE);
+  if (m->maplen > 0)
+    munmap(m->b.data, m->maplen);
+  m->b.data = NULL;
+  m->b.len = m->maplen = 0;
+  m->closed = 1;
+  return 0;
+}
+
+
+static int m_tostring (lua_State *L) {
+  MMap *m = (MMap *)luaL_checkudata(L, 1, MMAPHANDLE);
+  if (m->closed)
+    lua_pushliteral(L, "mmap (closed)");
+  else
+    lua_pushfstring(L, "mmap (%p)", (void *)m);
+  return 1;
+}
+
+
+static const luaL_Reg mmap_m[] = {
+  {"byte", m_byte},
+  {"close", m_close},
+  {"find", m_find},
+  {"len", m_len},
+  {"sub", m_sub},
+  {NULL, NULL}
+};
+
+
+static const luaL_Reg mmap_meta[] = {
+  {"__gc", m_gc},
+  {"__len", m_len},
+  {"__tostring", m_tostring},
+  {NULL, NULL}
+};
+
+#endif
+
+
+#if defined(IO_STATS)
+
+#define setstat(L,st,name)	\
+  (lua_pushnumber(L, (lua_Number)(st)->name), lua_setfield(L, -2, #name))
+
+/* the counters of the handle given at 1, or of the process */
+static IOStats *optstats (lua_State *L) {
+  if (lua_isnoneornil(L, 1))
+    return &iostats;
+  luaL_checkudata(L, 1, LUA_FILEHANDLE);
+  return handlestats(L, 1);
+}
+
+
+/*
+** io.stats([file]): a table of the counts of opens, closes (of popen
+** files), reads and writes, bytesread and byteswritten, and the seconds
+** spent in each kind of call; for the process, or for file (nil if file
+** wasn't made by this library).
+*/
+static int io_stats (lua_State *L) {
+  IOStats *st = optstats(L);
+  if (st == NULL)
+    return 0;
+  lua_createtable(L, 0, 10);
+  setstat(L, st, opens);
+  setstat(L, st, closes);
+  setstat(L, st, reads);
+  setstat(L, st, writes);
+  setstat(L, st, bytesread);
+  setstat(L, st, byteswritten);
+  setstat(L, st, opentime);
+  setstat(L, st, closetime);
+  setstat(L, st, readtime);
+  setstat(L, st, writetime);
+  return 1;
+}
+
+
+/* io.resetstats([file]): sets the counters of file, or the process, to 0 */
+static int io_resetstats (lua_State *L) {
+  IOStats *st = optstats(L);
+  if (st != NULL)
+    memset(st, 0, sizeof(IOStats));
+  return 0;
+}
+
+#endif
+
+
 static const luaL_Reg iolib[] = {
+  {"buffer", io_buffer},
+  {"copy", io_copy},
   {"open", io_open},
   {"lines", io_lines},
+  {"lineindex", io_lineindex},
   {"read", io_read},
+  {"readfile", io_readfile},
+  {"writefile", io_writefile},
+#if defined(LUA_USE_POSIX)
+  {"follow", io_follow},
+  {"pipe", io_pipe},
+  {"readmany", io_readmany},
+  {"socketpair", io_socketpair},
+#endif
+#if defined(IO_LOOP)
+  {"loop", io_loop},
+#endif
+#if defined(IO_ASYNCWRITER)
+  {"asyncwriter", io_asyncwriter},
+#endif
+#if defined(IO_STATS)
+  {"resetstats", io_resetstats},
+  {"stats", io_stats},
+#endif
   {NULL, NULL}
 };
 
@@ -414,9 +4928,23 @@ static const luaL_Reg iolib[] = {
 ** methods for file handles
 */
 static const luaL_Reg flib[] = {
+#if defined(LUA_USE_POSIX) && defined(POSIX_FADV_NORMAL)
+  {"advise", f_advise},
+#endif
+  {"line", f_line},
+  {"lineindex", f_lineindex},
+  {"linerange", f_linerange},
   {"lines", f_lines},
+  {"linesbatch", f_linesbatch},
+#if defined(LUA_USE_POSIX)
+  {"nonblock", f_nonblock},
+#endif
   {"read", f_read},
+  {"readinto", f_readinto},
+  {"readnumbers", f_readnumbers},
+  {"records", f_records},
   {"write", f_write},
+  {"writeall", f_writeall},
   {NULL, NULL}
 };
 
@@ -435,6 +4963,57 @@ extern int luaopen_fiveq_io (lua_State *L) {
   lua_replace(L, LUA_ENVIRONINDEX); /* we also use the io lib's fenv */
   lua_pop(L, 2);
   luaL_setfuncs(L, iolib, 0);  /* replacement library methods */
+  luaL_newmetatable(L, IOBUFFER);
+  luaL_newlib(L, iobuffer_m);
+  lua_setfield(L, -2, "__index");
+  lua_pushcfunction(L, buf_len);
+  lua_setfield(L, -2, "__len");
+  lua_pushcfunction(L, buf_tostring);
+  lua_setfield(L, -2, "__tostring");
+  lua_pushboolean(L, 1);
+  lua_setfield(L, -2, LUAQ_BUFFERFIELD);
+  lua_pop(L, 1);
+  luaL_newmetatable(L, LINEINDEX);
+  luaL_newlib(L, lineindex_m);
+  lua_setfield(L, -2, "__index");
+  lua_pushcfunction(L, ix_count);
+  lua_setfield(L, -2, "__len");
+  lua_pushcfunction(L, ix_gc);
+  lua_setfield(L, -2, "__gc");
+  lua_pushcfunction(L, ix_tostring);
+  lua_setfield(L, -2, "__tostring");
+  lua_pop(L, 1);
+  lua_newtable(L);  /* file handles' line indexes */
+  lua_createtable(L, 0, 1);
+  lua_pushliteral(L, "k");
+  lua_setfield(L, -2, "__mode");
+  lua_setmetatable(L, -2);
+  lua_setfield(L, LUA_REGISTRYINDEX, LINEINDEXES);
+#if defined(LUA_USE_POSIX)
+  lua_pushcfunction(L, io_mmap);
+  lua_setfield(L, -2, "mmap");
+  luaL_newmetatable(L, MMAPHANDLE);
+  luaL_setfuncs(L, mmap_meta, 0);
+  lua_pushboolean(L, 1);
+  lua_setfield(L, -2, LUAQ_BUFFERFIELD);
+  luaL_newlib(L, mmap_m);
+  lua_setfield(L, -2, "__index");
+  lua_pop(L, 1);
+  luaL_newmetatable(L, FOLLOW);
+  lua_pushcfunction(L, follow_gc);
+  lua_setfield(L, -2, "__gc");
+  lua_pop(L, 1);
+#endif
+#if defined(IO_ASYNCWRITER)
+  luaL_newmetatable(L, ASYNCWRITER);
+  luaL_newlib(L, asyncwriter_m);
+  lua_setfield(L, -2, "__index");
+  lua_pushcfunction(L, aw_gc);
+  lua_setfield(L, -2, "__gc");
+  lua_pushcfunction(L, aw_tostring);
+  lua_setfield(L, -2, "__tostring");
+  lua_pop(L, 1);
+#endif
   lua_getfield(L, -1, "popen");
   lua_getfenv(L, -1);
   lua_pushcfunction(L, io_pclose);
@@ -443,5 +5022,32 @@ extern int luaopen_fiveq_io (lua_State *L) {
   luaQ_checklib(L, LUA_OSLIBNAME);
   lua_pushcfunction(L, os_execute);
   lua_setfield(L, -2, "execute"); /* replace os.execute method */
+#if defined(LUA_USE_POSIX)
+#if defined(IO_LOOP)
+  luaL_newmetatable(L, LOOP);
+  luaL_newlib(L, loop_m);
+  lua_setfield(L, -2, "__index");
+  lua_pushcfunction(L, loop_gc);
+  lua_setfield(L, -2, "__gc");
+  lua_pop(L, 1);
+#endif
+  lua_pushcfunction(L, os_spawn);
+  lua_setfield(L, -2, "spawn");
+  lua_getfield(L, LUA_REGISTRYINDEX, UNREAPED);
+  if (lua_isnil(L, -1)) {  /* keep any pids listed by an earlier load */
+    lua_newtable(L);
+    lua_setfield(L, LUA_REGISTRYINDEX, UNREAPED);
+  }
+  lua_pop(L, 1);
+  luaL_newmetatable(L, PROCESS);
+  luaL_newlib(L, process_m);
+  lua_pushcclosure(L, p_index, 1);
+  lua_setfield(L, -2, "__index");
+  lua_pushcfunction(L, p_gc);
+  lua_setfield(L, -2, "__gc");
+  lua_pushcfunction(L, p_tostring);
+  lua_setfield(L, -2, "__tostring");
+  lua_pop(L, 1);
+#endif
   return 0;
 }
@@ -2,14 +2,17 @@
 #include <assert.h>
 #include <ctype.h>
 #include <limits.h>
+#include <stdio.h>
 #include <string.h>
 #include <stdbool.h>
+#include <stdint.h>
 
 #include <lua.h>
 #include <lauxlib.h>
 
 #define LUA_FIVEQ_PLUS
 #include "fiveq.h"
+#include "buffer.h"
 
 #ifndef LLONG_MAX
 #define LLONG_MAX    9223372036854775807LL
@@ -34,15 +37,28 @@
 ** h/H - signed/unsigned short
 ** l/L - signed/unsigned long
 ** i/I[num] - signed/unsigned integer with size 'n' (default is size of int)
+** j/J - signed/unsigned 64-bit integer, exchanged exactly as an int64 key
 ** cn - sequence of 'n' chars (from/to a string); when packing, n==0 means
         the whole string; when unpacking, n==0 means use the previous
         read number as the string length
 ** s        - zero-terminated string
+** v        - unsigned LEB128 varint
+** z        - signed varint, zigzag-encoded
+** p        - string preceded by its length as a varint
 ** f        - float
 ** d        - double
 ** ' '      - ignored
 ** '(' ')'  - stop assigning items. ')' start assigning (padding when packing)
 ** '='      - return current position / offset
+**
+** struct.packarray and struct.unpackarray1 take a single integer or float
+** option (optionally preceded by '<' or '>') describing every element.
+**
+** An int64 key is a userdata holding the integer's 64 bits. Keys are
+** interned, so equal integers give the very same key.
+**
+** A format compiled by struct.compile may be used wherever a format string
+** is expected (except by the array functions).
 */
 
 
@@ -64,6 +80,9 @@ struct cD {
 #define BIG	0
 #define LITTLE	1
 
+/* size of options 'j' and 'J' */
+#define INT64SIZE	8
+
 
 static union {
   int dummy;
@@ -106,6 +125,7 @@ static size_t getnum (const char **fmt, size_t df) {
 static size_t optsize (lua_State *L, char opt, const char **fmt) {
   switch (opt) {
     case 'B': case 'b': return sizeof(char);
+    case 'J': case 'j': return INT64SIZE;
     case 'H': case 'h': return sizeof(short);
     case 'L': case 'l': return sizeof(long);
     case 'f':  return sizeof(float);
@@ -113,7 +133,7 @@ static size_t optsize (lua_State *L, char opt, const char **fmt) {
     case 'x': return getnum(fmt, 1);
     case 'X': return getnum(fmt, MAXALIGN);
     case 'c': return getnum(fmt, 1);
-    case 's':
+    case 's': case 'v': case 'z': case 'p':
     case ' ':
     case '<':
     case '>':
@@ -136,9 +156,9 @@ static size_t optsize (lua_State *L, char opt, const char **fmt) {
 }
 
 
-static int gettoalign (size_t len, Header *h, int opt, size_t size) {
+static int gettoalign (size_t len, int align, int opt, size_t size) {
   if (size == 0 || opt == 'c' || opt == 's') return 0;
-  if (size > (size_t)h->align) size = h->align;  /* respect max. alignment */
+  if (size > (size_t)align) size = align;  /* respect max. alignment */
   return  (size - (len & (size - 1))) & (size - 1);
 }
 
@@ -162,6 +182,74 @@ static void commoncases (lua_State *L, int opt, const char **fmt, Header *h) {
 }
 
 
+/* a data option, together with the header settings in effect for it */
+typedef struct Op {
+  int opt;
+  size_t size;
+  int endian;
+  int align;
+  bool noassign;
+  bool dblswap;
+} Op;
+
+
+/* a format string compiled by struct.compile */
+typedef struct Format {
+  size_t nops;
+  Op ops[1];  /* followed by a copy of the format string */
+} Format;
+
+#define FORMAT	"fiveq.struct.format"
+
+#define formatsource(cf)	((const char *)((cf)->ops + ((cf)->nops ? \
+                                  (cf)->nops : 1)))
+
+
+/* where data options come from: a format string or a compiled format */
+typedef struct FormatState {
+  const char *fmt;
+  const Format *cf;
+  size_t i;
+  Header h;
+} FormatState;
+
+
+static void initformat (lua_State *L, int arg, FormatState *fs) {
+  fs->cf = (const Format *)luaL_testudata(L, arg, FORMAT);
+  fs->fmt = (fs->cf == NULL) ? luaL_checkstring(L, arg) : NULL;
+  fs->i = 0;
+  defaultoptions(&fs->h);
+}
+
+
+/* get the next data option, applying any control options before it */
+static bool nextop (lua_State *L, FormatState *fs, Op *op) {
+  if (fs->cf != NULL) {
+    if (fs->i >= fs->cf->nops) return false;
+    *op = fs->cf->ops[fs->i++];
+    return true;
+  }
+  while (*fs->fmt != '\0') {
+    int opt = *fs->fmt++;
+    size_t size = optsize(L, opt, &fs->fmt);
+    switch (opt) {
+      case ' ': case '<': case '>': case '(': case ')': case '!':
+        commoncases(L, opt, &fs->fmt, &fs->h);
+        break;
+      default:
+        op->opt = opt;
+        op->size = size;
+        op->endian = fs->h.endian;
+        op->align = fs->h.align;
+        op->noassign = fs->h.noassign;
+        op->dblswap = fs->h.dblswap;
+        return true;
+    }
+  }
+  return false;
+}
+
+
 static void putinteger (lua_State *L, luaL_Buffer *b, int arg, int endian,
                         int size) {
   lua_Number n = luaL_checknumber(L, arg);
@@ -183,6 +271,139 @@ static void putinteger (lua_State *L, luaL_Buffer *b, int arg, int endian,
 }
 
 
+/*
+** 64-bit integers that must survive exactly are exchanged with Lua as
+** int64 keys: userdata holding a uint64_t. A weak-valued registry table
+** maps each value's 8 big-endian bytes to its live key, so that equal
+** integers give the same key, which then works as a table key. Keys
+** compare as signed integers and add, subtract and negate modulo 2^64,
+** with each other or with numbers (see the int64 metamethods below).
+*/
+#define INT64KEY	"fiveq.struct.int64"
+#define INT64KEYS	"fiveq.struct.int64keys"
+
+static void pushint64 (lua_State *L, uint64_t v) {
+  char buff[INT64SIZE];
+  uint64_t bits = v;
+  int i;
+  for (i = INT64SIZE - 1; i >= 0; i--) {
+    buff[i] = (char)(bits & 0xff);
+    bits >>= 8;
+  }
+  luaL_checkstack(L, 3, "too many results to unpack");
+  lua_getfield(L, LUA_REGISTRYINDEX, INT64KEYS);
+  lua_pushlstring(L, buff, INT64SIZE);
+  lua_rawget(L, -2);
+  if (lua_isnil(L, -1)) {  /* no live key for v: make one */
+    uint64_t *key;
+    lua_pop(L, 1);
+    key = (uint64_t *)lua_newuserdata(L, sizeof(uint64_t));
+    *key = v;
+    luaL_getmetatable(L, INT64KEY);
+    lua_setmetatable(L, -2);
+    lua_pushlstring(L, buff, INT64SIZE);
+    lua_pushvalue(L, -2);
+    lua_rawset(L, -4);
+  }
+  lua_remove(L, -2);
+}
+
+
+static uint64_t getint64 (const char *buff, int endian) {
+  uint64_t v = 0;
+  int i;
+  for (i = 0; i < INT64SIZE; i++) {
+    int k = (endian == BIG) ? i : INT64SIZE - 1 - i;
+    v = (v << 8) | (unsigned char)buff[k];
+  }
+  return v;
+}
+
+
+/* accept an int64 key, or a number converted as for other integers */
+static uint64_t checkint64 (lua_State *L, int arg) {
+  const uint64_t *key = (const uint64_t *)luaL_testudata(L, arg, INT64KEY);
+  lua_Number n;
+  if (key != NULL)
+    return *key;
+  n = luaL_checknumber(L, arg);
+  if (n < (lua_Number)LLONG_MAX)
+    return (uint64_t)(long long)n;
+  else
+    return (uint64_t)n;
+}
+
+
+static void putint64 (luaL_Buffer *b, uint64_t value, int endian) {
+  int i;
+  for (i = 0; i < INT64SIZE; i++) {
+    int shift = (endian == BIG) ? 8 * (INT64SIZE - 1 - i) : 8 * i;
+    luaL_addchar(b, (char)((value >> shift) & 0xff));
+  }
+}
+
+
+/* most bytes a varint may take: 64 bits in 7-bit groups */
+#define MAXVARINT	10
+
+/* 2^63, exactly, as a lua_Number */
+#define TWO63	9223372036854775808.0
+
+
+static size_t putvarint (luaL_Buffer *b, unsigned long long value) {
+  size_t n = 1;
+  while (value >= 0x80) {
+    luaL_addchar(b, (char)((value & 0x7f) | 0x80));
+    value >>= 7;
+    n++;
+  }
+  luaL_addchar(b, (char)value);
+  return n;
+}
+
+
+static unsigned long long checkvarint (lua_State *L, int arg, int opt) {
+  lua_Number n = luaL_checknumber(L, arg);
+  long long v;
+  /* 'v' takes [-2^63, 2^64), negatives as two's complement; 'z' what
+     fits in 64 signed bits */
+  luaL_argcheck(L, n >= -TWO63 && n < ((opt == 'z') ? TWO63 : 2 * TWO63),
+                arg, "integer out of range for varint");
+  if (n >= TWO63)
+    return (unsigned long long)n;
+  v = (long long)n;
+  if (opt == 'z')  /* zigzag: small magnitudes give small codes */
+    return ((unsigned long long)v << 1) ^ (unsigned long long)(v >> 63);
+  return (unsigned long long)v;
+}
+
+
+/*
+** Decode the varint at data[pos]; returns the number of bytes it takes.
+** Varints longer than 10 bytes, or whose 10th byte holds more than the
+** 64th bit, are errors rather than silently truncated.
+*/
+static size_t getvarint (lua_State *L, const char *data, size_t ld,
+                         size_t pos, unsigned long long *value) {
+  unsigned long long v = 0;
+  size_t n = 0;
+  unsigned char c;
+  do {
+    if (pos + n >= ld)
+      luaL_argerror(L, 2, "data string too short");
+    if (n == MAXVARINT)
+      luaL_error(L, "varint too long in data");
+    c = (unsigned char)data[pos + n];
+    if (n == MAXVARINT - 1 && (c & 0x7f) > 1)
+      luaL_error(L, "varint overflows 64 bits in data");
+    v |= (unsigned long long)(c & 0x7f) << (7 * n);
+    n++;
+  } while (c & 0x80);
+  *value = v;
+  return n;
+}
+
+
 static void correctbytes (char *b, int size, int endian) {
   if (endian != native.endian) {
     int i = 0;
@@ -195,81 +416,115 @@ static void correctbytes (char *b, int size, int endian) {
 }
 
 
-static int b_pack (lua_State *L) {
+typedef struct PackState {
   luaL_Buffer b;
-  const char *fmt = luaL_checkstring(L, 1);
-  Header h;
-  int poscnt = 0;
+  int arg;  /* next argument to pack */
+  size_t totalsize;
+  int poscnt;
   int posBuf[10];
-  int arg = 2;
-  size_t totalsize = 0;
-  defaultoptions(&h);
-  lua_pushnil(L);  /* mark to separate arguments from string buffer */
-  luaL_buffinit(L, &b);
-  while (*fmt != '\0') {
-    int opt = *fmt++;
-    size_t size = optsize(L, opt, &fmt);
-    int toalign = gettoalign(totalsize, &h, opt, size);
-    totalsize += toalign;
-    while (toalign-- > 0) luaL_addchar(&b, '\0');
-    if (opt == 'X')
-        size = 0;
-    if (h.noassign && size)
-        opt = 'x';
-    switch (opt) {
-      case 'b': case 'B': case 'h': case 'H':
-      case 'l': case 'L': case 'i': case 'I': {  /* integer types */
-        putinteger(L, &b, arg++, h.endian, size);
-        break;
-      }
-      case 'x': case 'X': {
-        size_t l = size;
-        while (l-- > 0) luaL_addchar(&b, '\0');
-        break;
-      }
-      case 'f': {
-        float f = (float)luaL_checknumber(L, arg++);
-        correctbytes((char *)&f, size, h.endian);
-        luaL_addlstring(&b, (char *)&f, size);
-        break;
-      }
-      case 'd': {
-        union dblswap d;
-        d.dbl = luaL_checknumber(L, arg++);
-        correctbytes((char *)&d, size, h.endian);
-        if (h.dblswap) {
-            long tmp = d.l[0];
-            d.l[0] = d.l[1];
-            d.l[1] = tmp;
-        }
-        luaL_addlstring(&b, (char *)&d, size);
-        break;
-      }
-      case 'c': case 's': {
-        size_t l;
-        const char *s = luaL_checklstring(L, arg++, &l);
-        if (size == 0) size = l;
-        luaL_argcheck(L, l >= (size_t)size, arg, "string too short");
-        luaL_addlstring(&b, s, size);
-        if (opt == 's') {
-          luaL_addchar(&b, '\0');  /* add zero at the end */
-          size++;
-        }
-        break;
+} PackState;
+
+
+static void packop (lua_State *L, const Op *op, PackState *ps) {
+  int opt = op->opt;
+  size_t size = op->size;
+  int toalign = gettoalign(ps->totalsize, op->align, opt, size);
+  ps->totalsize += toalign;
+  while (toalign-- > 0) luaL_addchar(&ps->b, '\0');
+  if (opt == 'X')
+      size = 0;
+  if (op->noassign && size)
+      opt = 'x';
+  switch (opt) {
+    case 'b': case 'B': case 'h': case 'H':
+    case 'l': case 'L': case 'i': case 'I': {  /* integer types */
+      putinteger(L, &ps->b, ps->arg++, op->endian, size);
+      break;
+    }
+    case 'j': case 'J': {
+      putint64(&ps->b, checkint64(L, ps->arg++), op->endian);
+      break;
+    }
+    case 'x': case 'X': {
+      size_t l = size;
+      while (l-- > 0) luaL_addchar(&ps->b, '\0');
+      break;
+    }
+    case 'f': {
+      float f = (float)luaL_checknumber(L, ps->arg++);
+      correctbytes((char *)&f, size, op->endian);
+      luaL_addlstring(&ps->b, (char *)&f, size);
+      break;
+    }
+    case 'd': {
+      union dblswap d;
+      d.dbl = luaL_checknumber(L, ps->arg++);
+      correctbytes((char *)&d, size, op->endian);
+      if (op->dblswap) {
+          long tmp = d.l[0];
+          d.l[0] = d.l[1];
+          d.l[1] = tmp;
       }
-      case '=': {
-        if (poscnt < (int)(sizeof(posBuf)/sizeof(posBuf[0])))
-            posBuf[poscnt++] = totalsize + 1;
-        break;
+      luaL_addlstring(&ps->b, (char *)&d, size);
+      break;
+    }
+    case 'c': case 's': {
+      size_t l;
+      const char *s = luaL_checklstring(L, ps->arg++, &l);
+      if (size == 0) size = l;
+      luaL_argcheck(L, l >= (size_t)size, ps->arg, "string too short");
+      luaL_addlstring(&ps->b, s, size);
+      if (opt == 's') {
+        luaL_addchar(&ps->b, '\0');  /* add zero at the end */
+        size++;
       }
-      default: commoncases(L, opt, &fmt, &h);
+      break;
+    }
+    case 'v': case 'z': {
+      if (op->noassign)
+        size = putvarint(&ps->b, 0);
+      else
+        size = putvarint(&ps->b, checkvarint(L, ps->arg++, opt));
+      break;
+    }
+    case 'p': {
+      size_t l = 0;
+      const char *s = NULL;
+      if (!op->noassign)
+        s = luaL_checklstring(L, ps->arg++, &l);
+      size = putvarint(&ps->b, l);
+      luaL_addlstring(&ps->b, s, l);
+      size += l;
+      break;
+    }
+    case '=': {
+      if (ps->poscnt < (int)(sizeof(ps->posBuf)/sizeof(ps->posBuf[0])))
+          ps->posBuf[ps->poscnt++] = ps->totalsize + 1;
+      break;
     }
-    totalsize += size;
+    default: assert(0);
   }
-  luaL_pushresult(&b);
-  for (arg = 0; arg < poscnt; arg++)
-      lua_pushinteger(L, posBuf[arg]);
-  return poscnt + 1;
+  ps->totalsize += size;
+}
+
+
+static int b_pack (lua_State *L) {
+  PackState ps;
+  FormatState fs;
+  Op op;
+  int i;
+  initformat(L, 1, &fs);
+  ps.arg = 2;
+  ps.totalsize = 0;
+  ps.poscnt = 0;
+  lua_pushnil(L);  /* mark to separate arguments from string buffer */
+  luaL_buffinit(L, &ps.b);
+  while (nextop(L, &fs, &op))
+    packop(L, &op, &ps);
+  luaL_pushresult(&ps.b);
+  for (i = 0; i < ps.poscnt; i++)
+      lua_pushinteger(L, ps.posBuf[i]);
+  return ps.poscnt + 1;
 }
 
 
@@ -297,155 +552,1112 @@ static lua_Number getinteger (const char *buff, int endian,
 }
 
 static int b_size (lua_State *L) {
-  Header h;
-  const char *fmt = luaL_checkstring(L, 1);
+  FormatState fs;
+  Op op;
   size_t totalsize = 0;
-  defaultoptions(&h);
-  while (*fmt) {
-    int opt = *fmt++;
-    switch(opt) {
-      case  ' ': break;  /* ignore white spaces */
-      case '>': h.endian = BIG; break;
-      case '<': h.endian = LITTLE; break;
-      case '!': {
-        int a = getnum(&fmt, MAXALIGN);
-        if (!isp2(a))
-          luaL_error(L, "alignment %d is not a power of 2", a);
-        h.align = a;
-        break;
+  initformat(L, 1, &fs);
+  while (nextop(L, &fs, &op)) {
+    totalsize += gettoalign(totalsize, op.align, op.opt, op.size);
+    if (op.opt == 'X' || op.opt == '=')
+      continue;
+    if (op.size == 0)
+      luaL_error(L, "options 'c0', 's', 'v', 'z' and 'p' have undefined sizes");
+    totalsize += op.size;
+  }
+  lua_pushnumber(L, totalsize);
+  return 1;
+}
+
+
+/*
+** Data to unpack is either a string, or a userdata followed by its length.
+** The length of a buffer (see buffer.h) may be nil, meaning all of it.
+** Returns the index of the argument following them.
+*/
+static int getdata (lua_State *L, int arg, const char **data, size_t *ld) {
+  if (lua_isuserdata(L, arg)) {
+    luaQ_Buffer *b = luaQ_tobuffer(L, arg);
+    if (b != NULL) {
+      *data = b->data;
+      if (lua_isnoneornil(L, arg + 1))
+        *ld = b->len;
+      else {
+        *ld = (size_t)luaL_checkinteger(L, arg + 1);
+        luaL_argcheck(L, *ld <= b->len, arg + 1, "length beyond end of buffer");
+      }
+      return arg + 2;
+    }
+    *data = (const char *)lua_touserdata(L, arg);
+    *ld = (size_t)luaL_checkinteger(L, arg + 1);
+    return arg + 2;
+  }
+  *data = luaL_checklstring(L, arg, ld);
+  return arg + 1;
+}
+
+
+typedef struct UnpackState {
+  const char *data;
+  size_t ld;
+  size_t pos;
+  lua_Number lastnum;
+  int lastassign;
+  int top;  /* stack top after the values pushed so far */
+} UnpackState;
+
+
+static void initunpack (UnpackState *st, const char *data, size_t ld,
+                        size_t pos, int top) {
+  st->data = data;
+  st->ld = ld;
+  st->pos = pos;
+  st->lastnum = 0;
+  st->lastassign = -1;
+  st->top = top;
+}
+
+
+static void pushnumber (lua_State *L, UnpackState *st, const Op *op,
+                        lua_Number n) {
+  st->lastnum = n;
+  st->lastassign = !op->noassign;
+  if (!op->noassign) {
+    if (lua_checkstack(L, ++st->top))
+      lua_pushnumber(L, n);
+    else
+      luaL_error(L, "too many results to unpack");
+  }
+}
+
+
+static void unpackop (lua_State *L, const Op *op, UnpackState *st) {
+  int opt = op->opt;
+  size_t size = op->size;
+  size_t pos = st->pos;
+  const char *data = st->data;
+  pos += gettoalign(pos, op->align, opt, size);
+  luaL_argcheck(L, pos+size <= st->ld, 2, "data string too short");
+  if (opt == 'X')
+      size = 0;
+  switch (opt) {
+    case 'b': case 'B': case 'h': case 'H':
+    case 'l': case 'L': case 'i':  case 'I': {  /* integer types */
+      int issigned = islower(opt);
+      lua_Number res = getinteger(data+pos, op->endian, issigned, size);
+      pushnumber(L, st, op, res);
+      break;
+    }
+    case 'j': case 'J': {
+      /* we clear cached lastnum */
+      st->lastassign = -1;
+      if (!op->noassign) {
+          if (lua_checkstack(L, ++st->top))
+              pushint64(L, getint64(data+pos, op->endian));
+          else
+              luaL_error(L, "too many results to unpack");
+      }
+      break;
+    }
+    case 'x': case 'X': {
+      break;
+    }
+    case 'f': {
+      float f;
+      memcpy(&f, data+pos, size);
+      correctbytes((char *)&f, sizeof(f), op->endian);
+      pushnumber(L, st, op, f);
+      break;
+    }
+    case 'd': {
+      union dblswap d;
+      memcpy(&d, data+pos, size);
+      correctbytes((char *)&d, sizeof(d), op->endian);
+      if (op->dblswap) {
+          long tmp = d.l[0];
+          d.l[0] = d.l[1];
+          d.l[1] = tmp;
+      }
+      pushnumber(L, st, op, d.dbl);
+      break;
+    }
+    case 'c': {
+      if (size == 0) {
+        if (st->lastassign < 0) {
+          /* no cached lastnum available */
+          luaL_error(L, "format 'c0' needs a previous size");
+        } else if (st->lastnum < 0) {
+          luaL_error(L, "format 'c0' needs a size >= 0");
+        }
+        size = st->lastnum;
+        if (st->lastassign) {
+          lua_pop(L, 1);
+          st->top--;
+        }
+        luaL_argcheck(L, pos+size <= st->ld, 2, "data string too short");
+      }
+      /* we clear cached lastnum */
+      st->lastassign = -1;
+      if (!op->noassign) {
+          if (lua_checkstack(L, ++st->top))
+              lua_pushlstring(L, data+pos, size);
+          else
+              luaL_error(L, "too many results to unpack");
+      }
+      break;
+    }
+    case 's': {
+      const char *e = (const char *)memchr(data+pos, '\0', st->ld - pos);
+      if (e == NULL)
+        luaL_error(L, "unfinished string in data");
+      size = (e - (data+pos)) + 1;
+      /* we clear cached lastnum */
+      st->lastassign = -1;
+      if (!op->noassign) {
+          if (lua_checkstack(L, ++st->top))
+              lua_pushlstring(L, data+pos, size - 1);
+          else
+              luaL_error(L, "too many results to unpack");
       }
-      default: {
-        size_t size = optsize(L, opt, &fmt);
-        totalsize += gettoalign(totalsize, &h, opt, size);
-        if (size == 0)
-          luaL_error(L, "options 'c0' and 's' have undefined sizes");
-        totalsize += size;
+      break;
+    }
+    case 'v': case 'z': {
+      unsigned long long v;
+      size = getvarint(L, data, st->ld, pos, &v);
+      if (opt == 'v')
+        pushnumber(L, st, op, (lua_Number)v);
+      else
+        pushnumber(L, st, op, (lua_Number)(long long)((v >> 1) ^ -(v & 1)));
+      break;
+    }
+    case 'p': {
+      unsigned long long l;
+      size = getvarint(L, data, st->ld, pos, &l);
+      luaL_argcheck(L, l <= st->ld - (pos + size), 2, "data string too short");
+      /* we clear cached lastnum */
+      st->lastassign = -1;
+      if (!op->noassign) {
+          if (lua_checkstack(L, ++st->top))
+              lua_pushlstring(L, data+pos+size, (size_t)l);
+          else
+              luaL_error(L, "too many results to unpack");
       }
+      size += (size_t)l;
+      break;
     }
+    case '=': {
+      /* we clear cached lastnum */
+      st->lastassign = -1;
+      if (lua_checkstack(L, ++st->top))
+          lua_pushinteger(L, pos + 1);
+      else
+          luaL_error(L, "too many results to unpack");
+      break;
+    }
+    default: assert(0);
   }
-  lua_pushnumber(L, totalsize);
-  return 1;
+  st->pos = pos + size;
 }
 
+
 static int b_unpack (lua_State *L) {
-  Header h;
-  const char *fmt = luaL_checkstring(L, 1);
-  size_t ld;
+  FormatState fs;
+  UnpackState st;
+  Op op;
   const char *data;
+  size_t ld;
   size_t pos;
-  lua_Number lastnum = 0;
-  int lastassign = -1;
-  int top;
-
-#define pushnumber(n) { lastnum = (lua_Number)(n); lastassign = !h.noassign; \
-    if (!h.noassign) { if (lua_checkstack(L, ++top)) \
-        lua_pushnumber(L, (lua_Number)(n)); \
-        else luaL_error(L, "too many results to unpack"); } }
-
-  if (lua_isuserdata(L, 2)) {
-    data = (const char*)lua_touserdata(L, 2);
-    ld = (size_t)luaL_checkinteger(L, 3);
-    pos = luaL_optinteger(L, 4, 1) - 1;
-  } else {
-    data = luaL_checklstring(L, 2, &ld);
-    pos = luaL_optinteger(L, 3, 1) - 1;
+  initformat(L, 1, &fs);
+  pos = luaL_optinteger(L, getdata(L, 2, &data, &ld), 1) - 1;
+  lua_settop(L, 2);
+  /* reserve space for stop position at end */
+  initunpack(&st, data, ld, pos, 3);
+  while (nextop(L, &fs, &op))
+    unpackop(L, &op, &st);
+  /* push stop position */
+  lua_pushinteger(L, st.pos + 1);
+  return st.top - 2;
+}
+
+
+/* push a compiled version of the format string at index arg */
+static const Format *compileformat (lua_State *L, int arg) {
+  FormatState fs;
+  Op op;
+  Format *cf;
+  size_t n = 0, l;
+  const char *fmt = luaL_checklstring(L, arg, &l);
+  initformat(L, arg, &fs);
+  while (nextop(L, &fs, &op))
+    n++;
+  cf = (Format *)lua_newuserdata(L, sizeof(Format) +
+                                 ((n ? n : 1) - 1) * sizeof(Op) + l + 1);
+  cf->nops = n;
+  memcpy(cf->ops + (n ? n : 1), fmt, l + 1);
+  initformat(L, arg, &fs);
+  for (n = 0; nextop(L, &fs, &op); n++)
+    cf->ops[n] = op;
+  luaL_getmetatable(L, FORMAT);
+  lua_setmetatable(L, -2);
+  return cf;
+}
+
+
+static int b_compile (lua_State *L) {
+  if (luaL_testudata(L, 1, FORMAT) != NULL)
+    lua_settop(L, 1);  /* already compiled */
+  else
+    compileformat(L, 1);
+  return 1;
+}
+
+
+static int format_tostring (lua_State *L) {
+  const Format *cf = (const Format *)luaL_checkudata(L, 1, FORMAT);
+  lua_pushfstring(L, "struct.format (%s)", formatsource(cf));
+  return 1;
+}
+
+
+/*
+** upvalues: compiled format, data, data length, position of next record.
+** A buffer's bytes are looked up on every step, and no further than its
+** current length, since its provider may give them up between steps.
+*/
+static int records_iter (lua_State *L) {
+  const Format *cf = (const Format *)lua_touserdata(L, lua_upvalueindex(1));
+  UnpackState st;
+  size_t ld = (size_t)lua_tointeger(L, lua_upvalueindex(3));
+  size_t pos = (size_t)lua_tointeger(L, lua_upvalueindex(4));
+  const char *data;
+  size_t i;
+  if (lua_type(L, lua_upvalueindex(2)) == LUA_TSTRING)
+    data = lua_tostring(L, lua_upvalueindex(2));
+  else {
+    luaQ_Buffer *b = luaQ_tobuffer(L, lua_upvalueindex(2));
+    if (b != NULL) {
+      data = b->data;
+      if (ld > b->len)
+        ld = b->len;
+    }
+    else
+      data = (const char *)lua_touserdata(L, lua_upvalueindex(2));
   }
+  if (pos >= ld)  /* no more records? */
+    return 0;
+  lua_settop(L, 0);
+  lua_pushinteger(L, pos + 1);  /* record starts here */
+  initunpack(&st, data, ld, pos, 1);
+  for (i = 0; i < cf->nops; i++)
+    unpackop(L, &cf->ops[i], &st);
+  if (st.pos == pos)
+    return luaL_error(L, "record format consumes no data");
+  lua_pushinteger(L, st.pos);
+  lua_replace(L, lua_upvalueindex(4));
+  return st.top;
+}
+
+
+static int b_records (lua_State *L) {
+  const char *data;
+  size_t ld, pos;
+  int arg = getdata(L, 2, &data, &ld);
+  pos = luaL_optinteger(L, arg, 1) - 1;
+  luaL_argcheck(L, pos <= ld, arg, "initial position out of string");
+  if (luaL_testudata(L, 1, FORMAT) != NULL)
+    lua_pushvalue(L, 1);
+  else
+    compileformat(L, 1);
+  lua_pushvalue(L, 2);
+  lua_pushinteger(L, (lua_Integer)ld);
+  lua_pushinteger(L, (lua_Integer)pos);
+  lua_pushcclosure(L, records_iter, 4);
+  return 1;
+}
+
+/* }====================================================== */
+
+
+
+/*
+** {======================================================
+** Homogeneous arrays of integers or floats
+** =======================================================
+*/
+
+#if defined(__GNUC__) && (__GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 8))
+#define bswap16(x)	__builtin_bswap16(x)
+#define bswap32(x)	__builtin_bswap32(x)
+#define bswap64(x)	__builtin_bswap64(x)
+#else
+static uint16_t bswap16 (uint16_t x) {
+  return (uint16_t)((x >> 8) | (x << 8));
+}
+
+static uint32_t bswap32 (uint32_t x) {
+  return ((x >> 24) & 0xff) | ((x >> 8) & 0xff00) |
+         ((x & 0xff00) << 8) | (x << 24);
+}
+
+static uint64_t bswap64 (uint64_t x) {
+  return ((uint64_t)bswap32((uint32_t)x) << 32) | bswap32((uint32_t)(x >> 32));
+}
+#endif
+
+
+typedef struct ArrayType {
+  int opt;  /* 'i' or 'I' for integers, 'f' or 'd' for floats */
+  int size;
+  bool swap;  /* elements are in foreign byte order */
+  bool dblswap;
+} ArrayType;
+
+
+static void getarraytype (lua_State *L, int arg, ArrayType *at) {
+  const char *fmt = luaL_checkstring(L, arg);
+  Header h;
+  int opt;
   defaultoptions(&h);
-  lua_settop(L, 2);
-  top = 3; /* reserve space for stop position at end */
-  while (*fmt) {
-    int opt = *fmt++;
-    size_t size = optsize(L, opt, &fmt);
-    pos += gettoalign(pos, &h, opt, size);
-    luaL_argcheck(L, pos+size <= ld, 2, "data string too short");
-    if (opt == 'X')
-        size = 0;
-    switch (opt) {
-      case 'b': case 'B': case 'h': case 'H':
-      case 'l': case 'L': case 'i':  case 'I': {  /* integer types */
-        int issigned = islower(opt);
-        lua_Number res = getinteger(data+pos, h.endian, issigned, size);
-        pushnumber(res);
-        break;
+  while (*fmt == '<' || *fmt == '>' || *fmt == ' ') {
+    opt = *fmt++;
+    commoncases(L, opt, &fmt, &h);
+  }
+  opt = *fmt++;
+  switch (opt) {
+    case 'b': case 'h': case 'l': case 'i': at->opt = 'i'; break;
+    case 'B': case 'H': case 'L': case 'I': at->opt = 'I'; break;
+    case 'f': case 'd': at->opt = opt; break;
+    default:
+      luaL_argerror(L, arg, lua_pushfstring(L,
+                    "invalid array element type [%c]", opt ? opt : ' '));
+  }
+  at->size = (int)optsize(L, opt, &fmt);
+  if (*fmt != '\0')
+    luaL_argerror(L, arg, "array type must be a single option");
+  if (at->size != 1 && at->size != 2 && at->size != 4 && at->size != 8)
+    luaL_error(L, "array element size %d is not supported", at->size);
+  at->swap = (h.endian != native.endian && at->size > 1);
+  at->dblswap = (opt == 'd' && h.dblswap);
+}
+
+
+/* convert the number on top of the stack to element type, store it in p */
+static void putelem (lua_State *L, const ArrayType *at, char *p, int idx) {
+  lua_Number n = lua_tonumber(L, -1);
+  if (n == 0 && !lua_isnumber(L, -1))
+    luaL_error(L, "bad array element #%d (number expected, got %s)",
+               idx, luaL_typename(L, -1));
+  if (at->opt == 'f') {
+    float f = (float)n;
+    memcpy(p, &f, sizeof(f));
+  }
+  else if (at->opt == 'd') {
+    memcpy(p, &n, sizeof(n));
+  }
+  else {
+    uint64_t value;
+    if (n < (lua_Number)LLONG_MAX)
+      value = (uint64_t)(long long)n;
+    else
+      value = (uint64_t)n;
+    switch (at->size) {
+      case 1: { uint8_t v = (uint8_t)value; memcpy(p, &v, 1); break; }
+      case 2: { uint16_t v = (uint16_t)value; memcpy(p, &v, 2); break; }
+      case 4: { uint32_t v = (uint32_t)value; memcpy(p, &v, 4); break; }
+      default: memcpy(p, &value, 8); break;
+    }
+  }
+}
+
+
+static lua_Number getelem (const ArrayType *at, const char *p) {
+  switch (at->size) {
+    case 1: {
+      uint8_t v; memcpy(&v, p, 1);
+      return (at->opt == 'i') ? (lua_Number)(int8_t)v : (lua_Number)v;
+    }
+    case 2: {
+      uint16_t v; memcpy(&v, p, 2);
+      return (at->opt == 'i') ? (lua_Number)(int16_t)v : (lua_Number)v;
+    }
+    case 4: {
+      if (at->opt == 'f') {
+        float f; memcpy(&f, p, 4);
+        return (lua_Number)f;
       }
-      case 'x': case 'X': {
-        break;
+      else {
+        uint32_t v; memcpy(&v, p, 4);
+        return (at->opt == 'i') ? (lua_Number)(int32_t)v : (lua_Number)v;
       }
-      case 'f': {
-        float f;
-        memcpy(&f, data+pos, size);
-        correctbytes((char *)&f, sizeof(f), h.endian);
-        pushnumber(f);
-        break;
+    }
+    default: {
+      if (at->opt == 'd') {
+        double d; memcpy(&d, p, 8);
+        return (lua_Number)d;
       }
-      case 'd': {
-        union dblswap d;
-        memcpy(&d, data+pos, size);
-        correctbytes((char *)&d, sizeof(d), h.endian);
-        if (h.dblswap) {
-            long tmp = d.l[0];
-            d.l[0] = d.l[1];
-            d.l[1] = tmp;
-        }
-        pushnumber(d.dbl);
-        break;
+      else {
+        uint64_t v; memcpy(&v, p, 8);
+        return (at->opt == 'i') ? (lua_Number)(int64_t)v : (lua_Number)v;
       }
-      case 'c': {
-        if (size == 0) {
-          if (lastassign < 0) {
-            /* no cached lastnum available */
-            luaL_error(L, "format 'c0' needs a previous size");
-          } else if (lastnum < 0) {
-            luaL_error(L, "format 'c0' needs a size >= 0");
-          }
-          size = lastnum;
-          if (lastassign) {
-            lua_pop(L, 1);
-            top--;
-          }
-          luaL_argcheck(L, pos+size <= ld, 2, "data string too short");
-        }
-        /* we clear cached lastnum */
-        lastassign = -1;
-        if (!h.noassign) {
-            if (lua_checkstack(L, ++top))
-                lua_pushlstring(L, data+pos, size);
-            else
-                luaL_error(L, "too many results to unpack");
-        }
-        break;
+    }
+  }
+}
+
+
+/*
+** Convert n elements in place between native and foreign byte order;
+** written as plain loops over fixed-width words so the compiler can
+** vectorize them.
+*/
+static void swapelems (const ArrayType *at, char *p, size_t n) {
+  size_t k;
+  switch (at->size) {
+    case 2: {
+      for (k = 0; k < n; k++, p += 2) {
+        uint16_t v; memcpy(&v, p, 2); v = bswap16(v); memcpy(p, &v, 2);
       }
-      case 's': {
-        const char *e = (const char *)memchr(data+pos, '\0', ld - pos);
-        if (e == NULL)
-          luaL_error(L, "unfinished string in data");
-        size = (e - (data+pos)) + 1;
-        /* we clear cached lastnum */
-        lastassign = -1;
-        if (!h.noassign) {
-            if (lua_checkstack(L, ++top))
-                lua_pushlstring(L, data+pos, size - 1);
-            else
-                luaL_error(L, "too many results to unpack");
-        }
-        break;
+      break;
+    }
+    case 4: {
+      for (k = 0; k < n; k++, p += 4) {
+        uint32_t v; memcpy(&v, p, 4); v = bswap32(v); memcpy(p, &v, 4);
       }
-      case '=': {
-        /* we clear cached lastnum */
-        lastassign = -1;
-        if (lua_checkstack(L, ++top))
-            lua_pushinteger(L, pos + 1);
-        else
-            luaL_error(L, "too many results to unpack");
-        break;
+      break;
+    }
+    case 8: {
+      for (k = 0; k < n; k++, p += 8) {
+        uint64_t v; memcpy(&v, p, 8); v = bswap64(v);
+        if (at->dblswap)
+          v = (v << 32) | (v >> 32);
+        memcpy(p, &v, 8);
       }
-      default: commoncases(L, opt, &fmt, &h);
+      break;
     }
-    pos += size;
+    default: break;
   }
-  /* push stop position */
-  lua_pushinteger(L, pos + 1);
-  return top - 2;
+}
+
+
+/* foreign-order elements are unpacked through a block of this many */
+#define ARRAYCHUNK	512
+
+
+static int b_packarray (lua_State *L) {
+  ArrayType at;
+  lua_Integer i, j;
+  size_t n, k;
+  char *out;
+  getarraytype(L, 1, &at);
+  luaL_checktype(L, 2, LUA_TTABLE);
+  i = luaL_optinteger(L, 3, 1);
+  j = luaL_opt(L, luaL_checkinteger, 4, (lua_Integer)lua_objlen(L, 2));
+  if (i > j) {
+    lua_pushliteral(L, "");
+    return 1;
+  }
+  n = (size_t)(j - i) + 1;
+  if (n >= (size_t)INT_MAX / at.size)
+    return luaL_error(L, "array too large to pack");
+  out = (char *)lua_newuserdata(L, n * at.size);  /* scratch area */
+  for (k = 0; k < n; k++) {
+    lua_rawgeti(L, 2, (int)(i + k));
+    putelem(L, &at, out + k * at.size, (int)(i + k));
+    lua_pop(L, 1);
+  }
+  if (at.swap)
+    swapelems(&at, out, n);
+  lua_pushlstring(L, out, n * at.size);
+  return 1;
+}
+
+
+static int b_unpackarray (lua_State *L) {
+  ArrayType at;
+  const char *data;
+  size_t ld, pos, n, k;
+  int arg;
+  getarraytype(L, 1, &at);
+  arg = getdata(L, 2, &data, &ld);
+  pos = luaL_optinteger(L, arg, 1) - 1;
+  luaL_argcheck(L, pos <= ld, 2, "data string too short");
+  n = (ld - pos) / at.size;
+  if (!lua_isnoneornil(L, arg + 1)) {
+    size_t want = (size_t)luaL_checkinteger(L, arg + 1);
+    luaL_argcheck(L, want <= n, 2, "data string too short");
+    n = want;
+  }
+  luaL_argcheck(L, n <= (size_t)INT_MAX, 2, "too many array elements");
+  lua_createtable(L, (int)n, 0);
+  if (!at.swap) {
+    for (k = 0; k < n; k++) {
+      lua_pushnumber(L, getelem(&at, data + pos + k * at.size));
+      lua_rawseti(L, -2, (int)k + 1);
+    }
+  }
+  else {
+    char buff[ARRAYCHUNK * 8];
+    size_t done = 0;
+    while (done < n) {
+      size_t m = (n - done < ARRAYCHUNK) ? n - done : ARRAYCHUNK;
+      memcpy(buff, data + pos + done * at.size, m * at.size);
+      swapelems(&at, buff, m);
+      for (k = 0; k < m; k++) {
+        lua_pushnumber(L, getelem(&at, buff + k * at.size));
+        lua_rawseti(L, -2, (int)(done + k) + 1);
+      }
+      done += m;
+    }
+  }
+  lua_pushinteger(L, pos + n * at.size + 1);
+  return 2;
+}
+
+/* }====================================================== */
+
+
+/*
+** {======================================================
+** Cursors: typed reads from a data string, one field per call
+** =======================================================
+*/
+
+typedef struct Cursor {
+  const char *data;
+  size_t ld;
+  size_t pos;  /* 0-based offset of next read */
+} Cursor;
+
+#define CURSOR	"fiveq.struct.cursor"
+
+#define NATIVE	(-1)
+
+
+/* check that the cursor at index 1 has at least n bytes left */
+static Cursor *checkcursor (lua_State *L, size_t n) {
+  Cursor *c = (Cursor *)luaL_checkudata(L, 1, CURSOR);
+  if (n > c->ld - c->pos)
+    luaL_error(L, "data string too short");
+  return c;
+}
+
+
+static int cursorget (lua_State *L, int opt, int size, int endian) {
+  Cursor *c = checkcursor(L, size);
+  ArrayType at;
+  char buff[8];
+  at.opt = opt;
+  at.size = size;
+  at.swap = (endian != NATIVE && endian != native.endian && size > 1);
+  at.dblswap = (endian != NATIVE && opt == 'd' && swaptest.dbl == -2);
+  memcpy(buff, c->data + c->pos, size);
+  if (at.swap)
+    swapelems(&at, buff, 1);
+  lua_pushnumber(L, getelem(&at, buff));
+  c->pos += size;
+  return 1;
+}
+
+
+#define CURSORGET(name, opt, size, endian) \
+  static int name (lua_State *L) { return cursorget(L, opt, size, endian); }
+
+CURSORGET(cursor_u8, 'I', 1, NATIVE)
+CURSORGET(cursor_i8, 'i', 1, NATIVE)
+CURSORGET(cursor_u16le, 'I', 2, LITTLE)
+CURSORGET(cursor_u16be, 'I', 2, BIG)
+CURSORGET(cursor_i16le, 'i', 2, LITTLE)
+CURSORGET(cursor_i16be, 'i', 2, BIG)
+CURSORGET(cursor_u32le, 'I', 4, LITTLE)
+CURSORGET(cursor_u32be, 'I', 4, BIG)
+CURSORGET(cursor_i32le, 'i', 4, LITTLE)
+CURSORGET(cursor_i32be, 'i', 4, BIG)
+CURSORGET(cursor_u64le, 'I', 8, LITTLE)
+CURSORGET(cursor_u64be, 'I', 8, BIG)
+CURSORGET(cursor_i64le, 'i', 8, LITTLE)
+CURSORGET(cursor_i64be, 'i', 8, BIG)
+static int cursorint64 (lua_State *L, int endian) {
+  Cursor *c = checkcursor(L, INT64SIZE);
+  pushint64(L, getint64(c->data + c->pos, endian));
+  c->pos += INT64SIZE;
+  return 1;
+}
+
+static int cursor_int64le (lua_State *L) { return cursorint64(L, LITTLE); }
+static int cursor_int64be (lua_State *L) { return cursorint64(L, BIG); }
+
+CURSORGET(cursor_f32, 'f', 4, NATIVE)
+CURSORGET(cursor_f32le, 'f', 4, LITTLE)
+CURSORGET(cursor_f32be, 'f', 4, BIG)
+CURSORGET(cursor_f64, 'd', 8, NATIVE)
+CURSORGET(cursor_f64le, 'd', 8, LITTLE)
+CURSORGET(cursor_f64be, 'd', 8, BIG)
+
+
+static int cursor_bytes (lua_State *L) {
+  lua_Integer n = luaL_checkinteger(L, 2);
+  Cursor *c;
+  luaL_argcheck(L, n >= 0, 2, "negative count");
+  c = checkcursor(L, (size_t)n);
+  lua_pushlstring(L, c->data + c->pos, (size_t)n);
+  c->pos += (size_t)n;
+  return 1;
+}
+
+
+static int cursor_cstring (lua_State *L) {
+  Cursor *c = checkcursor(L, 0);
+  const char *s = c->data + c->pos;
+  const char *e = (const char *)memchr(s, '\0', c->ld - c->pos);
+  if (e == NULL)
+    return luaL_error(L, "unfinished string in data");
+  lua_pushlstring(L, s, e - s);
+  c->pos += (e - s) + 1;
+  return 1;
+}
+
+
+static int cursor_varint (lua_State *L) {
+  Cursor *c = checkcursor(L, 0);
+  unsigned long long v;
+  c->pos += getvarint(L, c->data, c->ld, c->pos, &v);
+  lua_pushnumber(L, (lua_Number)v);
+  return 1;
+}
+
+
+static int cursor_zigzag (lua_State *L) {
+  Cursor *c = checkcursor(L, 0);
+  unsigned long long v;
+  c->pos += getvarint(L, c->data, c->ld, c->pos, &v);
+  lua_pushnumber(L, (lua_Number)(long long)((v >> 1) ^ -(v & 1)));
+  return 1;
+}
+
+
+static int cursor_skip (lua_State *L) {
+  Cursor *c = checkcursor(L, 0);
+  lua_Integer n = luaL_checkinteger(L, 2);
+  if (n >= 0)
+    luaL_argcheck(L, (size_t)n <= c->ld - c->pos, 2, "data string too short");
+  else
+    luaL_argcheck(L, (size_t)-n <= c->pos, 2, "position out of string");
+  c->pos += n;
+  lua_settop(L, 1);
+  return 1;
+}
+
+
+static int cursor_align (lua_State *L) {
+  Cursor *c = checkcursor(L, 0);
+  size_t a = (size_t)luaL_checkinteger(L, 2);
+  size_t toalign;
+  if (!isp2(a))
+    luaL_error(L, "alignment %d is not a power of 2", (int)a);
+  toalign = (a - (c->pos & (a - 1))) & (a - 1);
+  checkcursor(L, toalign);
+  c->pos += toalign;
+  lua_settop(L, 1);
+  return 1;
+}
+
+
+static int cursor_tell (lua_State *L) {
+  Cursor *c = checkcursor(L, 0);
+  lua_pushinteger(L, (lua_Integer)c->pos + 1);
+  return 1;
+}
+
+
+static int cursor_seek (lua_State *L) {
+  Cursor *c = checkcursor(L, 0);
+  lua_Integer pos = luaL_checkinteger(L, 2);
+  luaL_argcheck(L, 1 <= pos && (size_t)pos <= c->ld + 1, 2,
+                "position out of string");
+  c->pos = (size_t)pos - 1;
+  lua_settop(L, 1);
+  return 1;
+}
+
+
+static int cursor_remaining (lua_State *L) {
+  Cursor *c = checkcursor(L, 0);
+  lua_pushinteger(L, (lua_Integer)(c->ld - c->pos));
+  return 1;
+}
+
+
+static int b_cursor (lua_State *L) {
+  Cursor *c;
+  const char *data;
+  size_t ld, pos;
+  int arg = getdata(L, 1, &data, &ld);
+  pos = luaL_optinteger(L, arg, 1) - 1;
+  luaL_argcheck(L, pos <= ld, arg, "initial position out of string");
+  c = (Cursor *)lua_newuserdata(L, sizeof(Cursor));
+  c->data = data;
+  c->ld = ld;
+  c->pos = pos;
+  luaL_getmetatable(L, CURSOR);
+  lua_setmetatable(L, -2);
+  lua_createtable(L, 1, 0);  /* keep the data alive with the cursor */
+  lua_pushvalue(L, 1);
+  lua_rawseti(L, -2, 1);
+  lua_setuservalue(L, -2);
+  return 1;
+}
+
+
+static const struct luaL_Reg cursor_m[] = {
+  {"u8", cursor_u8},
+  {"i8", cursor_i8},
+  {"u16le", cursor_u16le},
+  {"u16be", cursor_u16be},
+  {"i16le", cursor_i16le},
+  {"i16be", cursor_i16be},
+  {"u32le", cursor_u32le},
+  {"u32be", cursor_u32be},
+  {"i32le", cursor_i32le},
+  {"i32be", cursor_i32be},
+  {"u64le", cursor_u64le},
+  {"u64be", cursor_u64be},
+  {"i64le", cursor_i64le},
+  {"i64be", cursor_i64be},
+  {"int64le", cursor_int64le},
+  {"int64be", cursor_int64be},
+  {"f32", cursor_f32},
+  {"f32le", cursor_f32le},
+  {"f32be", cursor_f32be},
+  {"f64", cursor_f64},
+  {"f64le", cursor_f64le},
+  {"f64be", cursor_f64be},
+  {"bytes", cursor_bytes},
+  {"cstring", cursor_cstring},
+  {"varint", cursor_varint},
+  {"zigzag", cursor_zigzag},
+  {"skip", cursor_skip},
+  {"align", cursor_align},
+  {"tell", cursor_tell},
+  {"seek", cursor_seek},
+  {"remaining", cursor_remaining},
+  {NULL, NULL}
+};
+
+/* }====================================================== */
+
+
+/*
+** {======================================================
+** Schemas: named fields packed from and unpacked into tables
+** =======================================================
+*/
+
+typedef struct SchemaOp {
+  Op op;
+  int field;  /* index of the field's name, or 0 for padding */
+} SchemaOp;
+
+typedef struct Schema {
+  size_t nops;
+  int nfields;
+  SchemaOp ops[1];
+} Schema;
+
+#define SCHEMA	"fiveq.struct.schema"
+
+
+/*
+** Parse the format of schema entry i (at the top of the stack), appending
+** its options to sc when it is not NULL; returns the number of options.
+*/
+static size_t schemaentry (lua_State *L, FormatState *fs, int i, int field,
+                           Schema *sc) {
+  size_t n = 0;
+  int values = 0;
+  Op op;
+  fs->fmt = lua_tostring(L, -1);
+  if (fs->fmt == NULL)
+    luaL_error(L, "schema entry %d: format string expected", i);
+  while (nextop(L, fs, &op)) {
+    if (op.opt == '=' || (op.opt == 'c' && op.size == 0))
+      luaL_error(L, "schema entry %d: option [%c] not allowed", i, op.opt);
+    if (op.opt != 'x' && op.opt != 'X' && !op.noassign)
+      values++;
+    if (sc != NULL) {
+      sc->ops[sc->nops].op = op;
+      sc->ops[sc->nops].field = (op.opt == 'x' || op.opt == 'X' ||
+                                 op.noassign) ? 0 : field;
+      sc->nops++;
+    }
+    n++;
+  }
+  if (values != (field ? 1 : 0))
+    luaL_error(L, field ? "schema entry %d must describe one value"
+                        : "schema entry %d must only pad", i);
+  return n;
+}
+
+
+/* walk the entries of the table at index 1; see schemaentry */
+static size_t schemaentries (lua_State *L, Schema *sc) {
+  FormatState fs;
+  size_t n = 0;
+  int i, field = 0;
+  int len = (int)lua_objlen(L, 1);
+  fs.cf = NULL;  /* entries' formats run on as if concatenated */
+  defaultoptions(&fs.h);
+  for (i = 1; i <= len; i++) {
+    lua_rawgeti(L, 1, i);
+    if (lua_istable(L, -1)) {
+      field++;
+      if (sc != NULL) {  /* record the name */
+        lua_rawgeti(L, -1, 1);
+        if (!lua_isstring(L, -1))
+          luaL_error(L, "schema entry %d: field name expected", i);
+        lua_rawseti(L, 3, field);
+      }
+      lua_rawgeti(L, -1, 2);
+      n += schemaentry(L, &fs, i, field, sc);
+      lua_pop(L, 1);
+    }
+    else
+      n += schemaentry(L, &fs, i, 0, sc);
+    lua_pop(L, 1);
+  }
+  return n;
+}
+
+
+static int b_schema (lua_State *L) {
+  Schema *sc;
+  size_t n;
+  luaL_checktype(L, 1, LUA_TTABLE);
+  lua_settop(L, 1);
+  n = schemaentries(L, NULL);
+  lua_newtable(L);  /* field names, at index 2 */
+  sc = (Schema *)lua_newuserdata(L, sizeof(Schema) +
+                                 ((n ? n : 1) - 1) * sizeof(SchemaOp));
+  sc->nops = 0;
+  lua_insert(L, 2);
+  schemaentries(L, sc);  /* names go into the table now at index 3 */
+  sc->nfields = (int)lua_objlen(L, 3);
+  lua_setuservalue(L, 2);
+  luaL_getmetatable(L, SCHEMA);
+  lua_setmetatable(L, 2);
+  return 1;
+}
+
+
+/* schema:encode(tbl) */
+static int schema_encode (lua_State *L) {
+  Schema *sc = (Schema *)luaL_checkudata(L, 1, SCHEMA);
+  PackState ps;
+  int i;
+  size_t k;
+  luaL_checktype(L, 2, LUA_TTABLE);
+  lua_settop(L, 2);
+  lua_getuservalue(L, 1);  /* field names, at index 3 */
+  luaL_checkstack(L, sc->nfields + LUA_MINSTACK, "too many fields");
+  for (i = 1; i <= sc->nfields; i++) {  /* push values in field order */
+    lua_rawgeti(L, 3, i);
+    lua_gettable(L, 2);
+    if (lua_isnil(L, -1)) {
+      lua_rawgeti(L, 3, i);
+      return luaL_error(L, "missing field " LUA_QS, lua_tostring(L, -1));
+    }
+  }
+  ps.arg = 4;
+  ps.totalsize = 0;
+  ps.poscnt = 0;
+  lua_pushnil(L);  /* mark to separate values from string buffer */
+  luaL_buffinit(L, &ps.b);
+  for (k = 0; k < sc->nops; k++)
+    packop(L, &sc->ops[k].op, &ps);
+  luaL_pushresult(&ps.b);
+  return 1;
+}
+
+
+/* schema:decode(data, [pos], [into]) */
+static int schema_decode (lua_State *L) {
+  Schema *sc = (Schema *)luaL_checkudata(L, 1, SCHEMA);
+  UnpackState st;
+  const char *data;
+  size_t ld, pos, k;
+  int into, names;
+  int arg = getdata(L, 2, &data, &ld);
+  pos = luaL_optinteger(L, arg, 1) - 1;
+  if (lua_isnoneornil(L, arg + 1)) {
+    lua_settop(L, arg);
+    lua_createtable(L, 0, sc->nfields);
+  }
+  else {
+    luaL_checktype(L, arg + 1, LUA_TTABLE);
+    lua_settop(L, arg + 1);
+  }
+  into = arg + 1;
+  lua_getuservalue(L, 1);
+  names = arg + 2;
+  initunpack(&st, data, ld, pos, names);
+  for (k = 0; k < sc->nops; k++) {
+    unpackop(L, &sc->ops[k].op, &st);
+    if (sc->ops[k].field) {
+      lua_rawgeti(L, names, sc->ops[k].field);
+      lua_insert(L, -2);
+      lua_rawset(L, into);
+      st.top--;
+    }
+  }
+  lua_pushvalue(L, into);
+  lua_pushinteger(L, st.pos + 1);
+  return 2;
+}
+
+
+static const struct luaL_Reg schema_m[] = {
+  {"encode", schema_encode},
+  {"decode", schema_decode},
+  {NULL, NULL}
+};
+
+/* }====================================================== */
+
+
+
+/*
+** {======================================================
+** Conversions of int64 keys
+** =======================================================
+*/
+
+/* struct.int64(n or decimal string): make an int64 key */
+static int b_int64 (lua_State *L) {
+  if (lua_type(L, 1) == LUA_TSTRING) {
+    const char *s = lua_tostring(L, 1);
+    const char *p = s;
+    bool neg = false;
+    uint64_t v = 0;
+    while (isspace((unsigned char)*p)) p++;
+    if (*p == '-' || *p == '+')
+      neg = (*p++ == '-');
+    if (!isdigit((unsigned char)*p))
+      return luaL_argerror(L, 1, "malformed integer");
+    while (isdigit((unsigned char)*p)) {
+      int d = *p++ - '0';
+      if (v > (UINT64_MAX - d) / 10)
+        return luaL_argerror(L, 1, "integer out of range");
+      v = v * 10 + d;
+    }
+    while (isspace((unsigned char)*p)) p++;
+    if (*p != '\0')
+      return luaL_argerror(L, 1, "malformed integer");
+    if (neg) {
+      if (v > (uint64_t)INT64_MAX + 1)
+        return luaL_argerror(L, 1, "integer out of range");
+      v = 0 - v;
+    }
+    pushint64(L, v);
+  }
+  else {
+    lua_Number n = luaL_checknumber(L, 1);
+    if (n < (lua_Number)LLONG_MAX)
+      pushint64(L, (uint64_t)(long long)n);
+    else
+      pushint64(L, (uint64_t)n);
+  }
+  return 1;
+}
+
+
+static uint64_t checkkey (lua_State *L, int arg) {
+  const uint64_t *key = (const uint64_t *)luaL_testudata(L, arg, INT64KEY);
+  if (key == NULL)
+    luaL_typerror(L, arg, "int64 key");
+  return *key;
+}
+
+
+/* struct.int64tostring(key, [unsigned]) */
+static int b_int64tostring (lua_State *L) {
+  uint64_t v = checkkey(L, 1);
+  char buff[24];
+  if (lua_toboolean(L, 2))
+    sprintf(buff, "%llu", (unsigned long long)v);
+  else
+    sprintf(buff, "%lld", (long long)v);
+  lua_pushstring(L, buff);
+  return 1;
+}
+
+
+/* metamethods of int64 keys; operands may also be numbers */
+
+static int int64_tostring (lua_State *L) {
+  lua_settop(L, 1);
+  return b_int64tostring(L);
+}
+
+
+static int int64_eq (lua_State *L) {
+  uint64_t a = checkint64(L, 1), b = checkint64(L, 2);
+  lua_pushboolean(L, a == b);
+  return 1;
+}
+
+
+static int int64_lt (lua_State *L) {
+  int64_t a = (int64_t)checkint64(L, 1), b = (int64_t)checkint64(L, 2);
+  lua_pushboolean(L, a < b);
+  return 1;
+}
+
+
+static int int64_le (lua_State *L) {
+  int64_t a = (int64_t)checkint64(L, 1), b = (int64_t)checkint64(L, 2);
+  lua_pushboolean(L, a <= b);
+  return 1;
+}
+
+
+static int int64_add (lua_State *L) {
+  uint64_t a = checkint64(L, 1), b = checkint64(L, 2);
+  pushint64(L, a + b);
+  return 1;
+}
+
+
+static int int64_sub (lua_State *L) {
+  uint64_t a = checkint64(L, 1), b = checkint64(L, 2);
+  pushint64(L, a - b);
+  return 1;
+}
+
+
+static int int64_unm (lua_State *L) {
+  uint64_t a = checkint64(L, 1);
+  pushint64(L, 0 - a);
+  return 1;
+}
+
+
+static const struct luaL_Reg int64_m[] = {
+  {"__tostring", int64_tostring},
+  {"__eq", int64_eq},
+  {"__lt", int64_lt},
+  {"__le", int64_le},
+  {"__add", int64_add},
+  {"__sub", int64_sub},
+  {"__unm", int64_unm},
+  {NULL, NULL}
+};
+
+
+/* struct.int64tonumber(key, [unsigned]): may round beyond 2^53 */
+static int b_int64tonumber (lua_State *L) {
+  uint64_t v = checkkey(L, 1);
+  if (lua_toboolean(L, 2))
+    lua_pushnumber(L, (lua_Number)v);
+  else
+    lua_pushnumber(L, (lua_Number)(int64_t)v);
+  return 1;
 }
 
 /* }====================================================== */
@@ -456,11 +1668,41 @@ static const struct luaL_Reg slib[] = {
   {"pack", b_pack},
   {"unpack", b_unpack},
   {"size", b_size},
+  {"packarray", b_packarray},
+  {"unpackarray1", b_unpackarray},
+  {"compile", b_compile},
+  {"records", b_records},
+  {"cursor", b_cursor},
+  {"schema", b_schema},
+  {"int64", b_int64},
+  {"int64tostring", b_int64tostring},
+  {"int64tonumber", b_int64tonumber},
   {NULL, NULL}
 };
 
 
 LUALIB_API int luaopen_fiveq_struct (lua_State *L) {
+  luaL_newmetatable(L, FORMAT);
+  lua_pushcfunction(L, format_tostring);
+  lua_setfield(L, -2, "__tostring");
+  lua_pop(L, 1);
+  luaL_newmetatable(L, CURSOR);
+  luaL_newlib(L, cursor_m);
+  lua_setfield(L, -2, "__index");
+  lua_pop(L, 1);
+  luaL_newmetatable(L, SCHEMA);
+  luaL_newlib(L, schema_m);
+  lua_setfield(L, -2, "__index");
+  lua_pop(L, 1);
+  luaL_newmetatable(L, INT64KEY);
+  luaL_setfuncs(L, int64_m, 0);
+  lua_pop(L, 1);
+  lua_newtable(L);  /* live int64 keys, by value */
+  lua_createtable(L, 0, 1);
+  lua_pushliteral(L, "v");
+  lua_setfield(L, -2, "__mode");
+  lua_setmetatable(L, -2);
+  lua_setfield(L, LUA_REGISTRYINDEX, INT64KEYS);
   luaL_newlib(L, slib);
   return 1;
 }
@@ -0,0 +1,58 @@
+-- struct over io.mmap and io.buffer must decode what it does over a string.
+-- usage: lua-5.1 -lfiveq buffers.lua
+
+local path = os.tmpname()
+local parts = {}
+for i = 1, 4000 do
+    parts[i] = struct.pack("<i4d", i, i / 2)
+end
+local s = table.concat(parts)
+local f = assert(io.open(path, "wb"))
+f:write(s)
+f:close()
+
+local function collect(data, len)
+    local out = {}
+    for pos, id, x in struct.records("<i4d", data, len) do
+        out[#out + 1] = pos .. " " .. id .. " " .. x
+    end
+    return table.concat(out, ",")
+end
+
+local expected = collect(s)
+assert(expected:match("^1 1 0.5,13 2 1,"))
+
+local m = io.mmap and io.mmap(path)
+if m then
+    assert(collect(m) == expected, "records over a mapping")
+    assert(collect(m, m:len()) == expected, "records over a mapping, with length")
+    assert(collect(m, 120) == collect(s:sub(1, 120)), "records over part of a mapping")
+    assert(struct.unpack("<i4", m, m:len()) == 1)
+    assert(select(2, struct.unpack("<i4", m, nil, 13)) == 17)
+    assert(not pcall(struct.unpack, "<i4", m, m:len() + 1))
+    local c = struct.cursor(m)
+    assert(c:i32le() == 1 and c:f64le() == 0.5)
+    m:close()
+end
+
+local buf = io.buffer(#s)
+f = assert(io.open(path, "rb"))
+assert(f:readinto(buf, #s) == #s)
+f:close()
+assert(collect(buf) == expected, "records over a buffer")
+assert(collect(buf, 24) == collect(s:sub(1, 24)), "records over part of a buffer")
+
+-- a buffer refilled in chunks that hold whole records
+local chunk = io.buffer(12 * 100)
+local out = {}
+f = assert(io.open(path, "rb"))
+while f:readinto(chunk, chunk:size()) do
+    for _, id, x in struct.records("<i4d", chunk) do
+        out[#out + 1] = id .. " " .. x
+    end
+end
+f:close()
+assert(#out == 4000 and out[4000] == "4000 2000")
+
+os.remove(path)
+print("ok")
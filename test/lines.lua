@@ -0,0 +1,58 @@
+-- Throughput of line reading.
+-- usage: lua-5.1 -lfiveq lines.lua [file [megabytes]]
+-- Without a file, writes a scratch file of the given size (default 1024 MB)
+-- of lines between 0 and 160 characters long, then reads it back.
+
+local path, mb = arg[1], tonumber(arg[2]) or 1024
+local scratch = false
+
+if not path then
+    path = os.tmpname()
+    scratch = true
+    local f = assert(io.open(path, "w"))
+    local line = {}
+    for i = 1, 64 do
+        line[i] = string.rep("x", (i * 37) % 161) .. "\n"
+    end
+    local block = table.concat(line)
+    for _ = 1, math.ceil(mb * 1048576 / #block) do
+        f:write(block)
+    end
+    f:close()
+end
+
+local f = assert(io.open(path))
+local size = f:seek("end")
+f:close()
+
+local function bench(name, fn)
+    local t = os.clock()
+    local n = fn()
+    t = os.clock() - t
+    print(string.format("%-18s %8.1f MB/s  %10d lines  %6.2f s",
+        name, size / 1048576 / t, n, t))
+end
+
+bench("io.lines", function()
+    local n = 0
+    for _ in io.lines(path) do n = n + 1 end
+    return n
+end)
+
+bench("file:lines", function()
+    local n = 0
+    local f = assert(io.open(path))
+    for _ in f:lines() do n = n + 1 end
+    f:close()
+    return n
+end)
+
+bench('file:read "*L"', function()
+    local n = 0
+    local f = assert(io.open(path))
+    while f:read("*L") do n = n + 1 end
+    f:close()
+    return n
+end)
+
+if scratch then os.remove(path) end
@@ -0,0 +1,29 @@
+-- io.lines(name) must end the loop at end of file, not yield close's results.
+-- usage: lua-5.1 -lfiveq lineseof.lua
+
+local path = os.tmpname()
+local f = assert(io.open(path, "w"))
+f:write("one\ntwo\n")
+f:close()
+
+local got = {}
+for line in io.lines(path) do
+    assert(type(line) == "string", "iterator returned " .. tostring(line))
+    got[#got + 1] = line
+end
+assert(#got == 2 and got[1] == "one" and got[2] == "two")
+
+local it = io.lines(path)
+assert(it() == "one" and it() == "two")
+assert(select("#", it()) == 0, "nothing returned at end of file")
+assert(not pcall(it), "file is closed after end of file")
+
+-- an empty file ends at once
+f = assert(io.open(path, "w"))
+f:close()
+for line in io.lines(path) do
+    error("line from an empty file: " .. tostring(line))
+end
+
+os.remove(path)
+print("ok")
@@ -0,0 +1,120 @@
+-- io.loop over io.pipe and io.socketpair: reads, writes and timeouts.
+-- usage: lua-5.1 -lfiveq loop.lua
+
+if not io.loop then
+    print("skipped: no io.loop on this system")
+    return
+end
+
+-- lines written with pauses arrive in order, then end of file
+do
+    local lp = io.loop()
+    local r, w = io.pipe()
+    local got = {}
+    lp:spawn(function()
+        for word in ("alpha beta gamma"):gmatch("%S+") do
+            assert(lp:write(w, word .. "\n"))
+            lp:sleep(0.02)
+        end
+        w:close()
+    end)
+    lp:spawn(function()
+        while true do
+            local s = lp:read(r, nil, 2)
+            if not s then break end
+            got[#got + 1] = s
+        end
+        r:close()
+    end)
+    assert(lp:run(5) == true)
+    assert(table.concat(got) == "alpha\nbeta\ngamma\n")
+end
+
+-- a write bigger than the pipe suspends until the reader drains it
+do
+    local lp = io.loop()
+    local r, w = io.pipe()
+    local big = string.rep("0123456789abcdef", 65536)  -- 1 MB
+    local n = 0
+    lp:spawn(function()
+        assert(lp:write(w, big, 5))
+        w:close()
+    end)
+    lp:spawn(function()
+        local s = lp:read(r, 4096)
+        while s do  -- not a for loop: 5.1 can't yield from its iterator
+            n = n + #s
+            s = lp:read(r, 4096)
+        end
+        r:close()
+    end)
+    assert(lp:run(10) == true)
+    assert(n == #big, n)
+end
+
+-- read and write time out; run gives up on tasks still waiting
+do
+    local lp = io.loop()
+    local r, w = io.pipe()
+    local a, b = io.socketpair()
+    local readres, writeres
+    lp:spawn(function()
+        local t0 = lp:now()
+        readres = {lp:read(r, nil, 0.1)}
+        readres.waited = lp:now() - t0
+    end)
+    lp:spawn(function()
+        local chunk = string.rep("x", 65536)
+        local ok, err
+        repeat
+            ok, err = lp:write(a, chunk, 0.1)  -- nobody reads b
+        until not ok
+        writeres = err
+    end)
+    assert(lp:run(5) == true)
+    assert(readres[1] == nil and readres[2] == "timeout")
+    assert(readres.waited >= 0.09, readres.waited)
+    assert(writeres == "timeout")
+    lp:spawn(function() lp:sleep(10) end)
+    assert(lp:run(0.1) == false)
+    r:close() w:close() a:close() b:close()
+end
+
+-- request and reply over a socket pair, both ends in the loop
+do
+    local lp = io.loop()
+    local a, b = io.socketpair()
+    local reply
+    lp:spawn(function()
+        local req = lp:read(b, nil, 2)
+        assert(lp:write(b, "pong:" .. req))
+    end)
+    lp:spawn(function()
+        assert(lp:write(a, "ping"))
+        reply = lp:read(a, nil, 2)
+    end)
+    assert(lp:run(5) == true)
+    assert(reply == "pong:ping")
+    a:close() b:close()
+end
+
+-- errors in a task come out of run
+do
+    local lp = io.loop()
+    lp:spawn(function() lp:sleep() error("boom") end)
+    local ok, err = pcall(lp.run, lp, 1)
+    assert(not ok and tostring(err):find("boom"))
+end
+
+-- a non-blocking descriptor read outside the loop fails with EAGAIN
+do
+    local r, w = io.pipe()
+    assert(r:nonblock() == r)
+    local s, msg, code = r:read(1)
+    assert(s == nil and code ~= nil, tostring(msg))
+    w:write("z") w:flush()
+    assert(r:read(1) == "z")
+    r:close() w:close()
+end
+
+print("ok")
@@ -0,0 +1,42 @@
+-- io.readmany must read the same bytes with and without io_uring.
+-- usage: lua-5.1 -lfiveq readmany.lua
+
+local paths = {}
+
+-- files under /proc stat as empty but aren't: the first read fills the
+-- buffer sized by fstat, and the rest must follow on from there
+for _, p in ipairs{"/proc/version", "/proc/filesystems",
+                   "/proc/self/cmdline", "/proc/self/environ"} do
+    local f = io.open(p)
+    if f then
+        f:close()
+        paths[#paths + 1] = p
+    end
+end
+
+local big = os.tmpname()
+local f = assert(io.open(big, "wb"))
+for i = 1, 100000 do f:write(i, "\n") end
+f:close()
+paths[#paths + 1] = big
+
+local empty = os.tmpname()
+assert(io.open(empty, "wb")):close()
+paths[#paths + 1] = empty
+paths[#paths + 1] = "/nonexistent/file"
+
+local plain, perrs = io.readmany(paths, {uring = false})
+local ring, rerrs = io.readmany(paths, {uring = true})
+for i, p in ipairs(paths) do
+    local want = io.open(p, "rb")
+    want = want and want:read("*a") or false  -- readmany marks failures false
+    assert(plain[i] == want, p .. ": readmany without io_uring")
+    assert(ring[i] == want, p .. ": readmany with io_uring gave " ..
+           tostring(ring[i] and #ring[i]) .. " bytes, not " ..
+           tostring(want and #want))
+    assert((perrs[i] == nil) == (rerrs[i] == nil), p .. ": errors differ")
+end
+
+os.remove(big)
+os.remove(empty)
+print("ok")
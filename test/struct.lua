@@ -0,0 +1,136 @@
+-- Round trips through struct's arrays, compiled formats, records, varints,
+-- cursors, int64 keys and schemas.
+-- usage: lua-5.1 -lfiveq struct.lua
+
+local function fails(pattern, fn, ...)
+    local ok, err = pcall(fn, ...)
+    assert(not ok, "expected an error matching " .. pattern)
+    assert(tostring(err):find(pattern, 1, true), tostring(err))
+end
+
+-- packarray and unpackarray1
+do
+    local vec = {}
+    for i = 1, 100 do vec[i] = (i - 50) * 100 end
+    for _, t in ipairs{"<i4", ">i4", "<i8", ">i2", "<d", ">d", "<f"} do
+        local s = struct.packarray(t, vec)
+        local back, stop = struct.unpackarray1(t, s)
+        assert(stop == #s + 1, t)
+        for i = 1, 100 do assert(back[i] == vec[i], t .. " element " .. i) end
+    end
+    local s = struct.packarray("<I2", {1, 2, 3, 4}, 2, 3)
+    assert(s == "\2\0\3\0")
+    local part = struct.unpackarray1("<I2", struct.packarray("<I2", {7, 8, 9}), 3, 1)
+    assert(#part == 1 and part[1] == 8)
+    fails("data string too short", struct.unpackarray1, "<I2", "\1\0", 1, 2)
+end
+
+-- compiled formats and records
+do
+    local cf = struct.compile("<I2 d s")
+    assert(struct.compile(cf) == cf)
+    assert(tostring(cf) == "struct.format (<I2 d s)")
+    local parts = {}
+    for i = 1, 50 do parts[i] = struct.pack(cf, i, i / 4, "n" .. i) end
+    local s = table.concat(parts)
+    local i, pos = 0, 1
+    for start, a, b, c in struct.records(cf, s) do
+        i = i + 1
+        assert(start == pos and a == i and b == i / 4 and c == "n" .. i)
+        pos = pos + #parts[i]
+    end
+    assert(i == 50)
+    -- from a later start, with an uncompiled format
+    local n = 0
+    for _, a in struct.records("<I2 d s", s, #parts[1] + 1) do n = n + 1 end
+    assert(n == 49)
+    fails("data string too short", function()
+        for _ in struct.records("<I4", "\1\0\0\0\1") do end
+    end)
+end
+
+-- varints: v, z and p
+do
+    local values = {0, 1, 127, 128, 300, 16383, 16384, 2^31, 2^53, 2^63, 2^64 - 2^11}
+    for _, v in ipairs(values) do
+        local s = struct.pack("v", v)
+        local back, stop = struct.unpack("v", s)
+        assert(back == v and stop == #s + 1, "v " .. v)
+    end
+    assert(#struct.pack("v", 127) == 1 and #struct.pack("v", 128) == 2)
+    assert(#struct.pack("v", 2^63) == 10)
+    for _, v in ipairs{0, -1, 1, -64, 63, -65, 2^40, -2^40, -2^63} do
+        local s = struct.pack("z", v)
+        assert(struct.unpack("z", s) == v, "z " .. v)
+    end
+    assert(#struct.pack("z", -64) == 1 and #struct.pack("z", -65) == 2)
+    fails("out of range", struct.pack, "z", 2^63)
+    fails("out of range", struct.pack, "v", 2^64)
+    fails("out of range", struct.pack, "z", -2^64)
+    -- a 10th byte may only hold the 64th bit, and there is no 11th
+    local max = string.rep("\255", 9) .. "\1"
+    assert(struct.unpack("v", max) == 2^64)
+    fails("overflows", struct.unpack, "v", string.rep("\255", 9) .. "\2")
+    fails("too long", struct.unpack, "v", string.rep("\128", 10) .. "\0")
+    fails("data string too short", struct.unpack, "v", "\128")
+    local long = string.rep("x", 1000)
+    local s = struct.pack("pp", "", long)
+    local a, b, stop = struct.unpack("pp", s)
+    assert(a == "" and b == long and stop == #s + 1 and #s == 1 + 2 + 1000)
+end
+
+-- cursors
+do
+    local s = struct.pack("<B i2 >I4 <d c3 s", 200, -2, 65536, 0.25, "abc", "z") ..
+              struct.pack("vz", 300, -3)
+    local c = struct.cursor(s)
+    assert(c:u8() == 200 and c:i16le() == -2 and c:u32be() == 65536)
+    assert(c:f64le() == 0.25 and c:bytes(3) == "abc" and c:cstring() == "z")
+    assert(c:varint() == 300 and c:zigzag() == -3)
+    assert(c:remaining() == 0 and c:tell() == #s + 1)
+    fails("data string too short", c.u8, c)
+    assert(c:seek(2):i16le() == -2)
+    assert(c:seek(1):skip(1):align(4):tell() == 5)
+end
+
+-- int64 keys
+do
+    local big = struct.int64("9007199254740993")  -- 2^53 + 1
+    local s = struct.pack(">j<J", big, struct.int64(-1))
+    local a, b = struct.unpack(">j<J", s)
+    assert(rawequal(a, big) and struct.int64tostring(a) == "9007199254740993")
+    assert(struct.int64tostring(b, true) == "18446744073709551615")
+    assert(struct.int64tonumber(struct.int64(-7)) == -7)
+    local seen = {[a] = true}
+    assert(seen[struct.unpack(">j", s)])
+    assert(a + 1 > a and a - big == struct.int64(0) and -struct.int64(3) < struct.int64(0))
+    assert(tostring(a + 1) == "9007199254740994")
+    local c = struct.cursor(s)
+    assert(c:int64be() == big and c:int64le() == b)
+    assert(struct.unpack("<j", struct.pack("<j", 42)) == struct.int64(42))
+    fails("number expected", struct.pack, "<j", "abcdefgh")
+    fails("int64 key expected", struct.int64tostring, "abcdefgh")
+    fails("out of range", struct.int64, "18446744073709551616")
+end
+
+-- schemas
+do
+    local msg = struct.schema {
+        {"id", "<I4"},
+        {"ts", "d"},
+        "x4",
+        {"name", "p"},
+        {"big", "j"},
+    }
+    local t0 = {id = 7, ts = 1.5, name = "hello", big = struct.int64("-5")}
+    local s = msg:encode(t0)
+    local t, stop = msg:decode(s)
+    assert(stop == #s + 1)
+    for k, v in pairs(t0) do assert(t[k] == v, k) end
+    local into = {extra = true}
+    assert(msg:decode(s, 1, into) == into and into.id == 7 and into.extra)
+    fails("option [c] not allowed", struct.schema, {{"n", "c0"}})
+    fails("missing field", msg.encode, msg, {id = 1})
+end
+
+print("ok")